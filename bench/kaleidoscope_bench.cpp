@@ -0,0 +1,507 @@
+// kaleidoscope_bench - Throughput of the lexer, the parser and the code generator
+// over generated corpora: deeply nested expressions, calls with wide argument
+// lists, thousands of small definitions, comment-heavy input, and numeric
+// literals.  Reports tokens/s for gettok, AST nodes/s for parsing, functions/s
+// for generating IR from the tree and from the flat layout of -flat-ast, and
+// functions/s for generating, optimising and compiling a module at each of -O0
+// to -O3.  Also reports rows/s for EvaluateBatch against one call per row, after
+// checking that the two agree, including for a definition calling a function the
+// host registered with RegisterHostFunction.
+//
+// Usage: kaleidoscope_bench [--benchmark_filter=<regex>] [other benchmark flags]
+#define KALEIDOSCOPE_NO_MAIN
+#include "../parser.cpp"
+
+#include "llvm/IR/InstIterator.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <benchmark/benchmark.h>
+
+#include <random>
+
+namespace
+{
+/// Corpus - One generated input and what it contains, counted once up front so
+/// the timed loops only do the work being measured.
+struct Corpus
+{
+    std::string Name;
+    std::string Text;
+    size_t NumTokens = 0;
+    size_t NumNodes = 0;
+
+    // The definitions and externs, parsed once for the codegen benchmarks.
+    ASTArena Arena;
+    std::vector<FunctionAST *> Functions;
+    std::vector<PrototypeAST *> Externs;
+};
+
+const char Ops[] = {'+', '-', '*', '<'};
+
+/// makeDeep - Definitions whose bodies nest Depth levels of parentheses,
+/// alternately leaning left, "(((x + y) - x) * y)", and right,
+/// "x + (y - (x * y))".
+std::string makeDeep(unsigned NumDefs, unsigned Depth)
+{
+    std::string Src;
+    for (unsigned I = 0; I != NumDefs; ++I) {
+        Src += "def deep" + std::to_string(I) + "(x y) ";
+        if (I % 2 == 0) {
+            Src.append(Depth, '(');
+            Src += "x";
+            for (unsigned D = 0; D != Depth; ++D) {
+                Src += ' ';
+                Src += Ops[D % 4];
+                Src += D % 2 ? " x)" : " y)";
+            }
+        } else {
+            for (unsigned D = 0; D != Depth; ++D) {
+                Src += D % 2 ? "y " : "x ";
+                Src += Ops[D % 4];
+                Src += " (";
+            }
+            Src += "x";
+            Src.append(Depth, ')');
+        }
+        Src += "\n";
+    }
+    return Src;
+}
+
+/// makeWide - A function of Width arguments and NumDefs definitions that each
+/// call it with a different expression for every argument.
+std::string makeWide(unsigned NumDefs, unsigned Width)
+{
+    std::string Src = "def wide(";
+    for (unsigned A = 0; A != Width; ++A)
+        Src += (A ? " a" : "a") + std::to_string(A);
+    Src += ")";
+    for (unsigned A = 0; A != Width; ++A)
+        Src += (A ? " + a" : " a") + std::to_string(A);
+    Src += "\n";
+
+    for (unsigned I = 0; I != NumDefs; ++I) {
+        Src += "def widecall" + std::to_string(I) + "(x) wide(";
+        for (unsigned A = 0; A != Width; ++A) {
+            if (A)
+                Src += ", ";
+            Src += "x " + std::string(1, Ops[A % 4]) + " " + std::to_string(A + I);
+        }
+        Src += ")\n";
+    }
+    return Src;
+}
+
+/// makeDefs - NumDefs small definitions, each calling the one before it and an
+/// external function, the shape of a long script or library.
+std::string makeDefs(unsigned NumDefs)
+{
+    std::string Src = "extern sin(x)\ndef fn0(a b) a * b\n";
+    for (unsigned I = 1; I != NumDefs; ++I) {
+        std::string N = std::to_string(I);
+        Src += "def fn" + N + "(a b) a * b + fn" + std::to_string(I - 1) + "(b, a + " + N +
+               ") - sin(a)\n";
+    }
+    return Src;
+}
+
+/// makeComments - Definitions outnumbered by the comments around them: a block
+/// before each one and another at the end of its line.
+std::string makeComments(unsigned NumDefs)
+{
+    std::string Src;
+    for (unsigned I = 0; I != NumDefs; ++I) {
+        std::string N = std::to_string(I);
+        Src += "# cmt" + N + " - Combine the two arguments.  Nothing about this\n"
+               "# comment matters to the parser, which must still read every byte\n"
+               "#   of it, indentation and all, to find where the next line starts.\n"
+               "\n"
+               "def cmt" + N + "(a b)   # the arguments\n"
+               "    a * (b + " + N + ")   # the body\n\n";
+    }
+    return Src;
+}
+
+/// makeNumbers - Definitions made mostly of numeric literals of every shape:
+/// integers, fractions, and values written with up to 17 significant digits.
+std::string makeNumbers(unsigned NumDefs)
+{
+    std::mt19937 Rng(42);
+    std::string Src;
+    char Buf[32];
+    for (unsigned I = 0; I != NumDefs; ++I) {
+        Src += "def data" + std::to_string(I) + "(x) x";
+        for (unsigned K = 0; K != 16; ++K) {
+            switch (Rng() % 3) {
+                case 0: snprintf(Buf, sizeof(Buf), "%u", (unsigned)(Rng() % 100000)); break;
+                case 1: snprintf(Buf, sizeof(Buf), "%.3f", Rng() % 1000000 / 1000.0); break;
+                default: snprintf(Buf, sizeof(Buf), "%.17g", Rng() / 65536.0); break;
+            }
+            Src += K % 2 ? " * " : " + ";
+            Src += Buf;
+        }
+        Src += "\n";
+    }
+    return Src;
+}
+
+/// countNodes - The number of expression nodes in the tree under E.
+size_t countNodes(ExprAST *E)
+{
+    if (auto *B = dyn_cast<BinaryExprAST>(E))
+        return 1 + countNodes(B->getLHS()) + countNodes(B->getRHS());
+    if (auto *C = dyn_cast<CallExprAST>(E)) {
+        size_t N = 1;
+        for (ExprAST *Arg : C->getArgs())
+            N += countNodes(Arg);
+        return N;
+    }
+    return 1;
+}
+
+/// parseCorpus - Parse every item of C in turn as the driver would, resetting
+/// Arena after each one unless Keep is set, in which case the items are kept in
+/// C.Functions and C.Externs.  Returns the number of items.
+size_t parseCorpus(Corpus &C, SourceBuffer &SB, ASTArena &Arena, bool Keep)
+{
+    Lexer Lex(Symbols, SB);
+    Parser P(Lex, Arena);
+    P.setConstantFolding(FoldConstants);
+    P.getNextToken();
+
+    size_t NumItems = 0;
+    while (P.getCurTok() != tok_eof) {
+        bool Parsed;
+        switch (P.getCurTok()) {
+            case ';':
+                P.getNextToken();
+                continue;
+            case tok_def:
+                if (FunctionAST *F = P.ParseDefinition()) {
+                    Parsed = true;
+                    if (Keep)
+                        C.Functions.push_back(F);
+                } else {
+                    Parsed = false;
+                }
+                break;
+            case tok_extern:
+                if (PrototypeAST *Proto = P.ParseExtern()) {
+                    Parsed = true;
+                    if (Keep)
+                        C.Externs.push_back(Proto);
+                } else {
+                    Parsed = false;
+                }
+                break;
+            default:
+                Parsed = P.ParseTopLevelExpr() != nullptr;
+                break;
+        }
+        if (!Parsed) {
+            fprintf(stderr, "Error, corpus '%s' does not parse\n", C.Name.c_str());
+            exit(1);
+        }
+        ++NumItems;
+        if (!Keep)
+            Arena.reset();
+    }
+    return NumItems;
+}
+
+void BM_Lex(benchmark::State &State, Corpus *C)
+{
+    std::unique_ptr<SourceBuffer> SB = SourceBuffer::getMemory(C->Text);
+    for (auto _ : State) {
+        Lexer Lex(Symbols, *SB);
+        int Tok;
+        do
+            benchmark::DoNotOptimize(Tok = Lex.gettok());
+        while (Tok != tok_eof);
+    }
+    State.counters["tokens/s"] =
+            benchmark::Counter(C->NumTokens, benchmark::Counter::kIsIterationInvariantRate);
+    State.SetBytesProcessed(State.iterations() * C->Text.size());
+}
+
+void BM_Parse(benchmark::State &State, Corpus *C)
+{
+    std::unique_ptr<SourceBuffer> SB = SourceBuffer::getMemory(C->Text);
+    ASTArena Arena;
+    for (auto _ : State)
+        benchmark::DoNotOptimize(parseCorpus(*C, *SB, Arena, false));
+    State.counters["nodes/s"] =
+            benchmark::Counter(C->NumNodes, benchmark::Counter::kIsIterationInvariantRate);
+}
+
+/// setOptLevel - Switch code generation to -O<Level>, rebuilding the pass
+/// builder and target machine the current module is optimised and compiled with.
+void setOptLevel(char Level)
+{
+    static bool Initialized = false;
+    if (!Initialized) {
+        InitializeJIT();
+        Initialized = true;
+    }
+    OptLevel = Level;
+    TheJTMB->setCodeGenOptLevel(getCodeGenOptLevel());
+    ThePB.reset();
+    TheTM.reset();
+}
+
+void BM_Codegen(benchmark::State &State, Corpus *C, char Level)
+{
+    setOptLevel(Level);
+    SmallVector<char, 0> Obj;
+    for (auto _ : State) {
+        // Each definition goes through the per-function pipeline as it is
+        // generated, as in the REPL, then the module is compiled to an object.
+        InitializeModule();
+        TheModule->setTargetTriple(TheTM->getTargetTriple().str());
+        for (FunctionAST *F : C->Functions) {
+            if (!F->codegen()) {
+                State.SkipWithError("codegen failed");
+                return;
+            }
+        }
+
+        Obj.clear();
+        raw_svector_ostream OS(Obj);
+        legacy::PassManager CodeGenPasses;
+        if (TheTM->addPassesToEmitFile(CodeGenPasses, OS, nullptr, CGFT_ObjectFile)) {
+            State.SkipWithError("the host target cannot emit object files");
+            return;
+        }
+        CodeGenPasses.run(*TheModule);
+        benchmark::DoNotOptimize(Obj.data());
+    }
+    State.counters["functions/s"] = benchmark::Counter(
+            C->Functions.size(), benchmark::Counter::kIsIterationInvariantRate);
+}
+
+/// BM_IRGen - Generate unoptimised IR for every function of C, from the tree or,
+/// with Flat, from each body laid out as a FlatExpr.
+void BM_IRGen(benchmark::State &State, Corpus *C, bool Flat)
+{
+    setOptLevel('0');
+    FlatAST = Flat;
+    for (auto _ : State) {
+        InitializeModule();
+        for (FunctionAST *F : C->Functions) {
+            if (!F->codegen()) {
+                State.SkipWithError("codegen failed");
+                break;
+            }
+        }
+    }
+    FlatAST = false;
+    State.counters["functions/s"] = benchmark::Counter(
+            C->Functions.size(), benchmark::Counter::kIsIterationInvariantRate);
+}
+
+/// makeCorpus - Build a corpus from Text and count what it contains.
+std::unique_ptr<Corpus> makeCorpus(std::string Name, std::string Text)
+{
+    auto C = std::make_unique<Corpus>();
+    C->Name = std::move(Name);
+    C->Text = std::move(Text);
+    std::unique_ptr<SourceBuffer> SB = SourceBuffer::getMemory(C->Text);
+
+    Lexer Lex(Symbols, *SB);
+    while (Lex.gettok() != tok_eof)
+        ++C->NumTokens;
+
+    parseCorpus(*C, *SB, C->Arena, true);
+    for (FunctionAST *F : C->Functions)
+        C->NumNodes += countNodes(F->getBody());
+
+    // Every module declares the externs from their prototypes, as it would
+    // after the driver had read them.
+    for (PrototypeAST *Proto : C->Externs)
+        RememberPrototype(*Proto);
+    return C;
+}
+
+/// BatchCase - A definition handed to the JIT with its batch wrapper, as
+/// -batch-wrappers compiles it, and columns of input for it.
+struct BatchCase
+{
+    std::string Name;
+    std::unique_ptr<Corpus> Source;
+    JITTargetAddress Scalar = 0;
+    std::vector<std::vector<double>> Columns;
+    std::vector<const double *> Cols;
+    std::vector<double> Out;
+};
+
+/// callRow - Call the definition itself on row I of Cols.
+double callRow(const BatchCase &B, size_t I)
+{
+    const std::vector<const double *> &C = B.Cols;
+    switch (C.size()) {
+        case 1: return ((double (*)(double))B.Scalar)(C[0][I]);
+        case 2: return ((double (*)(double, double))B.Scalar)(C[0][I], C[1][I]);
+        case 3:
+            return ((double (*)(double, double, double))B.Scalar)(C[0][I], C[1][I], C[2][I]);
+        default: llvm_unreachable("no batch case takes this many arguments");
+    }
+}
+
+/// makeBatchCase - Compile the definition Src of Name at -O2 with its wrapper,
+/// give it NumRows rows of input, and check that EvaluateBatch agrees with
+/// calling the definition row by row.  NumRows is odd, so the rows left over
+/// after the vector loop are checked too.  CheckIR, if set, is shown the
+/// definition's IR before it is optimised.
+std::unique_ptr<BatchCase> makeBatchCase(std::string Name, std::string Src, size_t NumRows,
+                                         void (*CheckIR)(Function &) = nullptr)
+{
+    auto B = std::make_unique<BatchCase>();
+    B->Name = Name;
+    B->Source = makeCorpus("batch/" + Name, std::move(Src));
+
+    setOptLevel('2');
+    InitializeModule();
+    Function *F = B->Source->Functions.front()->codegen();
+    if (!F) {
+        fprintf(stderr, "Error, batch case '%s' does not compile\n", Name.c_str());
+        exit(1);
+    }
+    if (CheckIR)
+        CheckIR(*F);
+    EmitBatchWrapper(F);
+    OptimizeModule();
+    AddModuleToJIT();
+    B->Scalar = cantFail(LookupSymbol(Name)).getAddress();
+
+    std::mt19937 Rng(42);
+    std::uniform_real_distribution<double> Dist(-100, 100);
+    B->Columns.resize(F->arg_size());
+    for (std::vector<double> &Column : B->Columns) {
+        for (size_t I = 0; I != NumRows; ++I)
+            Column.push_back(Dist(Rng));
+        B->Cols.push_back(Column.data());
+    }
+    B->Out.assign(NumRows, -1);
+
+    if (!EvaluateBatch(Name, B->Cols, B->Out.data(), 0) || B->Out.front() != -1) {
+        fprintf(stderr, "Error, EvaluateBatch of no rows of '%s' wrote a result\n",
+                Name.c_str());
+        exit(1);
+    }
+    if (!EvaluateBatch(Name, B->Cols, B->Out.data(), NumRows))
+        exit(1);
+    for (size_t I = 0; I != NumRows; ++I) {
+        double Expected = callRow(*B, I);
+        if (B->Out[I] != Expected) {
+            fprintf(stderr, "Error, EvaluateBatch of '%s' gives %g for row %zu, not %g\n",
+                    Name.c_str(), B->Out[I], I, Expected);
+            exit(1);
+        }
+    }
+    return B;
+}
+
+/// hostFloor - Registered in place of libm's floor, and told apart from it by
+/// the half it adds.
+double hostFloor(double X)
+{
+    return std::floor(X) + 0.5;
+}
+
+/// checkHostCalls - The IR of batchhost: floor, registered by the host, must be
+/// called, not lowered to llvm.floor, while ceil still is lowered to llvm.ceil.
+void checkHostCalls(Function &F)
+{
+    bool CallsFloor = false, LowersCeil = false;
+    for (Instruction &I : instructions(F)) {
+        if (auto *Call = dyn_cast<CallInst>(&I)) {
+            CallsFloor |= Call->getCalledFunction()->getName() == "floor";
+            LowersCeil |= Call->getIntrinsicID() == Intrinsic::ceil;
+        }
+    }
+    if (!CallsFloor || !LowersCeil) {
+        fprintf(stderr, "Error, batchhost does not call the registered floor and the "
+                        "llvm.ceil intrinsic\n");
+        exit(1);
+    }
+}
+
+/// makeHostCase - A batch case whose definition calls a host function, and so
+/// checks RegisterHostFunction: the registered floor must be what runs.
+std::unique_ptr<BatchCase> makeHostCase(size_t NumRows)
+{
+    RegisterHostFunction("floor", (void *)hostFloor);
+    std::unique_ptr<BatchCase> B = makeBatchCase(
+            "batchhost", "extern floor(x)\nextern ceil(x)\ndef batchhost(x) floor(x) * ceil(x)",
+            NumRows, checkHostCalls);
+    for (size_t I = 0; I != NumRows; ++I) {
+        double X = B->Cols[0][I];
+        if (B->Out[I] != hostFloor(X) * std::ceil(X)) {
+            fprintf(stderr, "Error, batchhost does not run the registered floor\n");
+            exit(1);
+        }
+    }
+    return B;
+}
+
+/// BM_EvaluateBatch - Run a definition over every row of its columns, through
+/// its batch wrapper or, with PerRow, one call per row.
+void BM_EvaluateBatch(benchmark::State &State, BatchCase *B, bool PerRow)
+{
+    size_t NumRows = B->Out.size();
+    for (auto _ : State) {
+        if (PerRow) {
+            for (size_t I = 0; I != NumRows; ++I)
+                B->Out[I] = callRow(*B, I);
+        } else {
+            EvaluateBatch(B->Name, B->Cols, B->Out.data(), NumRows);
+        }
+        benchmark::DoNotOptimize(B->Out.data());
+    }
+    State.counters["rows/s"] =
+            benchmark::Counter(NumRows, benchmark::Counter::kIsIterationInvariantRate);
+}
+} // end anonymous namespace
+
+int main(int argc, char **argv)
+{
+    std::vector<std::unique_ptr<Corpus>> Corpora;
+    Corpora.push_back(makeCorpus("deep", makeDeep(50, 100)));
+    Corpora.push_back(makeCorpus("wide", makeWide(200, 32)));
+    Corpora.push_back(makeCorpus("defs", makeDefs(2000)));
+    Corpora.push_back(makeCorpus("comments", makeComments(1000)));
+    Corpora.push_back(makeCorpus("numbers", makeNumbers(1000)));
+
+    for (auto &C : Corpora) {
+        benchmark::RegisterBenchmark(("lex/" + C->Name).c_str(), BM_Lex, C.get());
+        benchmark::RegisterBenchmark(("parse/" + C->Name).c_str(), BM_Parse, C.get());
+        benchmark::RegisterBenchmark(("irgen/" + C->Name + "/tree").c_str(), BM_IRGen, C.get(),
+                                     false);
+        benchmark::RegisterBenchmark(("irgen/" + C->Name + "/flat").c_str(), BM_IRGen, C.get(),
+                                     true);
+        for (char Level = '0'; Level <= '3'; ++Level)
+            benchmark::RegisterBenchmark(
+                    ("codegen/" + C->Name + "/O" + Level).c_str(), BM_Codegen, C.get(), Level)
+                    ->Unit(benchmark::kMillisecond);
+    }
+
+    std::vector<std::unique_ptr<BatchCase>> BatchCases;
+    BatchCases.push_back(makeBatchCase("batchpoly", "def batchpoly(x) x * x * 0.5 + x * 3 - 7",
+                                       100001));
+    BatchCases.push_back(makeBatchCase("batchmix", "def batchmix(a b c) a * b + c - (a < c) * b",
+                                       100001));
+    BatchCases.push_back(makeHostCase(100001));
+    for (auto &B : BatchCases) {
+        benchmark::RegisterBenchmark(("batch/" + B->Name + "/wrapper").c_str(),
+                                     BM_EvaluateBatch, B.get(), false);
+        benchmark::RegisterBenchmark(("batch/" + B->Name + "/rows").c_str(), BM_EvaluateBatch,
+                                     B.get(), true);
+    }
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -0,0 +1,124 @@
+// precedence_bench - Compare binary operator precedence lookup through the
+// constexpr PrecedenceTable against the std::map<char, int> the parser used
+// before, over the token stream of a long operator-heavy expression.
+//
+// Usage: precedence_bench [tokens] [iterations]
+#include "../precedence.h"
+#include <chrono>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace
+{
+// The parser's token values for the things the expression is built from.
+enum { tok_identifier = -4, tok_number = -5 };
+
+/// makeExpression - A random expression such as "(a*b+2)<c-d*e..." of roughly
+/// NumTokens tokens.
+std::string makeExpression(size_t NumTokens)
+{
+    static const char Ops[] = {'+', '-', '*', '<'};
+    std::mt19937 Rng(42);
+    std::string Src;
+    int Depth = 0;
+    for (size_t I = 0; I < NumTokens; I += 2) {
+        if (Rng() % 8 == 0) {
+            Src += '(';
+            ++Depth;
+        }
+        Src += Rng() % 3 ? char('a' + Rng() % 26) : char('0' + Rng() % 10);
+        if (Depth && Rng() % 8 == 0) {
+            Src += ')';
+            --Depth;
+        }
+        Src += Ops[Rng() % 4];
+    }
+    Src += 'x';
+    Src.append(Depth, ')');
+    return Src;
+}
+
+/// tokenize - The token values gettok would return for Src.
+std::vector<int> tokenize(const std::string &Src)
+{
+    std::vector<int> Toks;
+    for (char C : Src) {
+        if (isalpha((unsigned char)C))
+            Toks.push_back(tok_identifier);
+        else if (isdigit((unsigned char)C))
+            Toks.push_back(tok_number);
+        else
+            Toks.push_back((unsigned char)C);
+    }
+    return Toks;
+}
+
+/// The lookup the parser did before PrecedenceTable.
+std::map<char, int> BinopMap;
+
+int getMapPrecedence(int Tok)
+{
+    if (!isascii(Tok))
+        return -1;
+
+    int TokPrec = BinopMap[Tok];
+    if (TokPrec <= 0) return -1;
+    return TokPrec;
+}
+
+PrecedenceTable BinopTable = PrecedenceTable::standard();
+
+int getTablePrecedence(int Tok)
+{
+    return BinopTable.get(Tok);
+}
+
+template <typename LookupFn>
+double timeLookups(const std::vector<int> &Toks, unsigned Iters, LookupFn Lookup,
+                   long &Checksum)
+{
+    auto Start = std::chrono::steady_clock::now();
+    long Sum = 0;
+    for (unsigned It = 0; It != Iters; ++It)
+        for (int Tok : Toks)
+            Sum += Lookup(Tok);
+    auto End = std::chrono::steady_clock::now();
+    Checksum = Sum;
+    return std::chrono::duration<double, std::nano>(End - Start).count() /
+           (double(Toks.size()) * Iters);
+}
+} // end anonymous namespace
+
+int main(int argc, char **argv)
+{
+    size_t NumTokens = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000000;
+    unsigned Iters = argc > 2 ? strtoul(argv[2], nullptr, 10) : 20;
+
+    BinopMap['<'] = 10;
+    BinopMap['+'] = 20;
+    BinopMap['-'] = 30;
+    BinopMap['*'] = 40;
+
+    std::vector<int> Toks = tokenize(makeExpression(NumTokens));
+
+    long MapSum, TableSum;
+    double MapNs = timeLookups(Toks, Iters,
+                               [](int Tok) { return getMapPrecedence(Tok); }, MapSum);
+    double TableNs = timeLookups(Toks, Iters,
+                                 [](int Tok) { return getTablePrecedence(Tok); },
+                                 TableSum);
+
+    printf("tokens: %zu, iterations: %u\n", Toks.size(), Iters);
+    printf("std::map        %8.3f ns/lookup\n", MapNs);
+    printf("PrecedenceTable %8.3f ns/lookup  (%.1fx)\n", TableNs, MapNs / TableNs);
+    if (MapSum != TableSum) {
+        fprintf(stderr, "Error, lookups disagree (%ld vs %ld)\n", MapSum, TableSum);
+        return 1;
+    }
+    return 0;
+}
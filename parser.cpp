@@ -1,9 +1,573 @@
+#include "precedence.h"
+#include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/ScopeExit.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/IR/Type.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Pass.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/SmallVectorMemoryBuffer.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Scalar/Reassociate.h"
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "llvm/Transforms/Utils/Mem2Reg.h"
+#include <algorithm>
+#include <atomic>
 #include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdint>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
 #include <string>
+#include <thread>
 #include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
 #include <vector>
-#include <map>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+using namespace llvm;
+using namespace llvm::orc;
+
+/*---------------------------------------------------------------------------------
+ * Source input
+ *-------------------------------------------------------------------------------*/
+/// SourceBuffer - The text the lexer walks.  A file named on the command line is
+/// memory-mapped in one go; standard input is read in large blocks, each one
+/// extended to the end of a line so that a token never straddles two reads and
+/// the REPL still sees every line as soon as it is typed.  The text is followed
+/// by a '\0' sentinel, so the lexer can scan with a bare pointer and only has to
+/// compare against end() between tokens; a view of part of a file ends where
+/// every scan stops anyway instead.
+class SourceBuffer
+{
+    static const size_t BlockSize = 64 * 1024;
+
+    const char *BufStart = nullptr;
+    const char *BufEnd = nullptr;
+    size_t BufOffset = 0;   // Stream offset of BufStart
+
+    // Memory-mapped file input.
+    void *MapAddr = nullptr;
+    size_t MapSize = 0;
+
+    // Block-read stream input; FD is -1 once the stream has hit EOF.
+    int FD = -1;
+    std::vector<char> Storage;
+
+    SourceBuffer() = default;
+    SourceBuffer(const SourceBuffer &) = delete;
+    SourceBuffer &operator=(const SourceBuffer &) = delete;
+
+public:
+    ~SourceBuffer()
+    {
+        if (MapAddr)
+            munmap(MapAddr, MapSize);
+    }
+
+    /// getFile - Map the named file, or return null if it cannot be read.
+    static std::unique_ptr<SourceBuffer> getFile(const char *Path)
+    {
+        int FileFD = open(Path, O_RDONLY | O_CLOEXEC);
+        if (FileFD < 0)
+            return nullptr;
+
+        struct stat St;
+        if (fstat(FileFD, &St) != 0) {
+            close(FileFD);
+            return nullptr;
+        }
+        if (!S_ISREG(St.st_mode)) {
+            close(FileFD);
+            errno = S_ISDIR(St.st_mode) ? EISDIR : EINVAL;
+            return nullptr;
+        }
+
+        std::unique_ptr<SourceBuffer> SB(new SourceBuffer());
+        size_t Size = St.st_size;
+        if (Size == 0) {
+            close(FileFD);
+            SB->Storage.assign(1, '\0');
+            SB->BufStart = SB->BufEnd = SB->Storage.data();
+            return SB;
+        }
+
+        // Reserve one byte more than the file, rounded up to whole pages, as
+        // zero-filled anonymous memory and map the file over the front of it.
+        // Whatever follows the last byte of the file reads as '\0', even when the
+        // file size is an exact multiple of the page size.
+        size_t PageSize = sysconf(_SC_PAGESIZE);
+        size_t MapSize = (Size + 1 + PageSize - 1) & ~(PageSize - 1);
+        void *Base = mmap(nullptr, MapSize, PROT_READ,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (Base == MAP_FAILED) {
+            close(FileFD);
+            return nullptr;
+        }
+        if (mmap(Base, Size, PROT_READ, MAP_PRIVATE | MAP_FIXED, FileFD, 0) ==
+            MAP_FAILED) {
+            munmap(Base, MapSize);
+            close(FileFD);
+            return nullptr;
+        }
+        close(FileFD);
+        madvise(Base, MapSize, MADV_SEQUENTIAL);
+
+        SB->MapAddr = Base;
+        SB->MapSize = MapSize;
+        SB->BufStart = static_cast<const char *>(Base);
+        SB->BufEnd = SB->BufStart + Size;
+        return SB;
+    }
+
+    /// getStdin - Read standard input lazily, one block at a time.
+    static std::unique_ptr<SourceBuffer> getStdin()
+    {
+        std::unique_ptr<SourceBuffer> SB(new SourceBuffer());
+        SB->FD = STDIN_FILENO;
+        SB->Storage.assign(1, '\0');
+        SB->BufStart = SB->BufEnd = SB->Storage.data();
+        return SB;
+    }
+
+    /// getMemory - Copy Text into a buffer of its own, as though it had been read
+    /// from a file.
+    static std::unique_ptr<SourceBuffer> getMemory(llvm::StringRef Text)
+    {
+        std::unique_ptr<SourceBuffer> SB(new SourceBuffer());
+        SB->Storage.assign(Text.begin(), Text.end());
+        SB->Storage.push_back('\0');
+        SB->BufStart = SB->Storage.data();
+        SB->BufEnd = SB->BufStart + Text.size();
+        return SB;
+    }
+
+    /// getView - The piece Text of the complete buffer Whole, without copying
+    /// it.  Text must end where Whole does or at the start of a line starting
+    /// with a keyword: every scan the lexer makes stops at the line end before
+    /// it or at the keyword, so none runs past a view's end.
+    static std::unique_ptr<SourceBuffer> getView(const SourceBuffer &Whole, llvm::StringRef Text)
+    {
+        std::unique_ptr<SourceBuffer> SB(new SourceBuffer());
+        SB->BufStart = Text.begin();
+        SB->BufEnd = Text.end();
+        SB->BufOffset = Whole.getOffset(Text.begin());
+        return SB;
+    }
+
+    const char *begin() const { return BufStart; }
+    const char *end() const { return BufEnd; }
+
+    /// isComplete - Whether the whole input is in the buffer already, as it is
+    /// for anything but a stream.
+    bool isComplete() const { return FD < 0; }
+
+    /// getOffset - The stream offset of P, which must point into the buffer.
+    size_t getOffset(const char *P) const { return BufOffset + (P - BufStart); }
+
+    /// getText - The bytes covered by a range.  Stream input only keeps the
+    /// current block, so the range must lie in it; on stdin a view is valid
+    /// until the buffer is next refilled.
+    llvm::StringRef getText(size_t Offset, size_t Length) const
+    {
+        return llvm::StringRef(BufStart + (Offset - BufOffset), Length);
+    }
+
+    /// refill - Replace the (fully consumed) contents with the next block of the
+    /// stream.  Returns false once there is nothing left to read; mapped files
+    /// are complete from the start and never refill.
+    bool refill()
+    {
+        if (FD < 0)
+            return false;
+
+        size_t Len = 0;
+        while (true) {
+            if (Storage.size() < Len + BlockSize + 1)
+                Storage.resize(Len + BlockSize + 1);
+            ssize_t N = read(FD, Storage.data() + Len, BlockSize);
+            if (N < 0 && errno == EINTR)
+                continue;
+            if (N <= 0) {
+                FD = -1;
+                break;
+            }
+            Len += N;
+            if (Storage[Len - 1] == '\n')
+                break;
+        }
+
+        if (Len == 0)
+            return false;
+
+        Storage[Len] = '\0';
+        BufOffset += BufEnd - BufStart;
+        BufStart = Storage.data();
+        BufEnd = BufStart + Len;
+        return true;
+    }
+};
+
+/*---------------------------------------------------------------------------------
+ * Scanning
+ *-------------------------------------------------------------------------------*/
+// The lexer skips whitespace and comments a vector at a time: SSE2 or AVX2 on
+// x86, whichever the CPU has, NEON on ARM, and a byte at a time elsewhere.  The
+// loads are aligned, so they never cross into a page the buffer does not
+// touch, and the '\0' sentinel stops every scan at the end of the text; the
+// bytes loaded from either side of the text itself are masked off or never
+// looked at.
+
+/// IsSpace - isspace() in the "C" locale, which is the one the driver runs in.
+static inline bool IsSpace(char C)
+{
+    return C == ' ' || (unsigned char)(C - '\t') <= '\r' - '\t';
+}
+
+#if defined(__SSE2__)
+static const char *SkipWhitespaceSSE2(const char *P)
+{
+    const __m128i Space = _mm_set1_epi8(' '), Tab = _mm_set1_epi8('\t');
+    const __m128i CtlRange = _mm_set1_epi8('\r' - '\t');
+    unsigned Offset = (uintptr_t)P & 15;
+    const __m128i *Block = (const __m128i *)(P - Offset);
+    unsigned Valid = (0xFFFFu << Offset) & 0xFFFFu;   // The bytes at or after P
+    while (true) {
+        __m128i B = _mm_load_si128(Block);
+        __m128i Ctl = _mm_sub_epi8(B, Tab);
+        __m128i IsCtl = _mm_cmpeq_epi8(_mm_min_epu8(Ctl, CtlRange), Ctl);
+        __m128i IsWS = _mm_or_si128(IsCtl, _mm_cmpeq_epi8(B, Space));
+        unsigned Other = ~(unsigned)_mm_movemask_epi8(IsWS) & Valid;
+        if (Other)
+            return (const char *)Block + countTrailingZeros(Other);
+        ++Block;
+        Valid = 0xFFFFu;
+    }
+}
+
+static const char *SkipToLineEndSSE2(const char *P)
+{
+    const __m128i NL = _mm_set1_epi8('\n'), CR = _mm_set1_epi8('\r');
+    const __m128i Zero = _mm_setzero_si128();
+    unsigned Offset = (uintptr_t)P & 15;
+    const __m128i *Block = (const __m128i *)(P - Offset);
+    unsigned Valid = (0xFFFFu << Offset) & 0xFFFFu;
+    while (true) {
+        __m128i B = _mm_load_si128(Block);
+        __m128i End = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(B, NL), _mm_cmpeq_epi8(B, CR)),
+                                   _mm_cmpeq_epi8(B, Zero));
+        unsigned Hits = (unsigned)_mm_movemask_epi8(End) & Valid;
+        if (Hits)
+            return (const char *)Block + countTrailingZeros(Hits);
+        ++Block;
+        Valid = 0xFFFFu;
+    }
+}
+
+__attribute__((target("avx2")))
+static const char *SkipWhitespaceAVX2(const char *P)
+{
+    const __m256i Space = _mm256_set1_epi8(' '), Tab = _mm256_set1_epi8('\t');
+    const __m256i CtlRange = _mm256_set1_epi8('\r' - '\t');
+    unsigned Offset = (uintptr_t)P & 31;
+    const __m256i *Block = (const __m256i *)(P - Offset);
+    uint32_t Valid = ~uint32_t(0) << Offset;
+    while (true) {
+        __m256i B = _mm256_load_si256(Block);
+        __m256i Ctl = _mm256_sub_epi8(B, Tab);
+        __m256i IsCtl = _mm256_cmpeq_epi8(_mm256_min_epu8(Ctl, CtlRange), Ctl);
+        __m256i IsWS = _mm256_or_si256(IsCtl, _mm256_cmpeq_epi8(B, Space));
+        uint32_t Other = ~(uint32_t)_mm256_movemask_epi8(IsWS) & Valid;
+        if (Other)
+            return (const char *)Block + countTrailingZeros(Other);
+        ++Block;
+        Valid = ~uint32_t(0);
+    }
+}
+
+__attribute__((target("avx2")))
+static const char *SkipToLineEndAVX2(const char *P)
+{
+    const __m256i NL = _mm256_set1_epi8('\n'), CR = _mm256_set1_epi8('\r');
+    const __m256i Zero = _mm256_setzero_si256();
+    unsigned Offset = (uintptr_t)P & 31;
+    const __m256i *Block = (const __m256i *)(P - Offset);
+    uint32_t Valid = ~uint32_t(0) << Offset;
+    while (true) {
+        __m256i B = _mm256_load_si256(Block);
+        __m256i End = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(B, NL), _mm256_cmpeq_epi8(B, CR)),
+                _mm256_cmpeq_epi8(B, Zero));
+        uint32_t Hits = (uint32_t)_mm256_movemask_epi8(End) & Valid;
+        if (Hits)
+            return (const char *)Block + countTrailingZeros(Hits);
+        ++Block;
+        Valid = ~uint32_t(0);
+    }
+}
+#elif defined(__ARM_NEON)
+/// NeonMask - Narrow a vector of 0x00/0xFF bytes to a 64-bit mask with four bits
+/// per byte, NEON having no movemask.
+static inline uint64_t NeonMask(uint8x16_t Match)
+{
+    uint8x8_t Narrowed = vshrn_n_u16(vreinterpretq_u16_u8(Match), 4);
+    return vget_lane_u64(vreinterpret_u64_u8(Narrowed), 0);
+}
+
+static const char *SkipWhitespaceNEON(const char *P)
+{
+    const uint8x16_t Space = vdupq_n_u8(' '), Tab = vdupq_n_u8('\t');
+    const uint8x16_t CtlRange = vdupq_n_u8('\r' - '\t');
+    unsigned Offset = (uintptr_t)P & 15;
+    const uint8_t *Block = (const uint8_t *)(P - Offset);
+    uint64_t Valid = ~uint64_t(0) << (4 * Offset);
+    while (true) {
+        uint8x16_t B = vld1q_u8(Block);
+        uint8x16_t IsWS = vorrq_u8(vcleq_u8(vsubq_u8(B, Tab), CtlRange), vceqq_u8(B, Space));
+        uint64_t Other = NeonMask(vmvnq_u8(IsWS)) & Valid;
+        if (Other)
+            return (const char *)Block + countTrailingZeros(Other) / 4;
+        Block += 16;
+        Valid = ~uint64_t(0);
+    }
+}
+
+static const char *SkipToLineEndNEON(const char *P)
+{
+    const uint8x16_t NL = vdupq_n_u8('\n'), CR = vdupq_n_u8('\r');
+    unsigned Offset = (uintptr_t)P & 15;
+    const uint8_t *Block = (const uint8_t *)(P - Offset);
+    uint64_t Valid = ~uint64_t(0) << (4 * Offset);
+    while (true) {
+        uint8x16_t B = vld1q_u8(Block);
+        uint8x16_t End = vorrq_u8(vorrq_u8(vceqq_u8(B, NL), vceqq_u8(B, CR)), vceqzq_u8(B));
+        uint64_t Hits = NeonMask(End) & Valid;
+        if (Hits)
+            return (const char *)Block + countTrailingZeros(Hits) / 4;
+        Block += 16;
+        Valid = ~uint64_t(0);
+    }
+}
+#else
+/// SkipWhitespaceScalar/SkipToLineEndScalar - The byte-at-a-time versions of
+/// SkipWhitespace and SkipToLineEnd below.
+static const char *SkipWhitespaceScalar(const char *P)
+{
+    while (IsSpace(*P))
+        ++P;
+    return P;
+}
+
+static const char *SkipToLineEndScalar(const char *P)
+{
+    while (*P != '\0' && *P != '\n' && *P != '\r')
+        ++P;
+    return P;
+}
+#endif
+
+typedef const char *(*ScanFn)(const char *);
+
+/// HostHasAVX2 - Whether this CPU runs the AVX2 scanners.
+static bool HostHasAVX2()
+{
+#if defined(__SSE2__)
+    __builtin_cpu_init();   // This may run before the constructor that does it
+    return __builtin_cpu_supports("avx2");
+#else
+    return false;
+#endif
+}
+
+/// SkipWhitespaceImpl/SkipToLineEndImpl - The widest versions the CPU runs.
+static const ScanFn SkipWhitespaceImpl =
+#if defined(__SSE2__)
+        HostHasAVX2() ? SkipWhitespaceAVX2 : SkipWhitespaceSSE2;
+#elif defined(__ARM_NEON)
+        SkipWhitespaceNEON;
+#else
+        SkipWhitespaceScalar;
+#endif
+
+static const ScanFn SkipToLineEndImpl =
+#if defined(__SSE2__)
+        HostHasAVX2() ? SkipToLineEndAVX2 : SkipToLineEndSSE2;
+#elif defined(__ARM_NEON)
+        SkipToLineEndNEON;
+#else
+        SkipToLineEndScalar;
+#endif
+
+/// SkipWhitespace - The first byte at or after P that is not whitespace, which
+/// may be the sentinel.  Tokens are mostly one space apart, so the first two
+/// bytes are looked at before going to the vector code.
+static inline const char *SkipWhitespace(const char *P)
+{
+    if (!IsSpace(P[0]))
+        return P;
+    if (!IsSpace(P[1]))
+        return P + 1;
+    return SkipWhitespaceImpl(P + 2);
+}
+
+/// SkipToLineEnd - The first '\n', '\r' or '\0' at or after P.
+static inline const char *SkipToLineEnd(const char *P)
+{
+    return SkipToLineEndImpl(P);
+}
+
+/*---------------------------------------------------------------------------------
+ * Instrumentation
+ *-------------------------------------------------------------------------------*/
+// LLVM's own -time-passes and -stats switch on a report of where the time went
+// and how much was done, written as JSON to -info-output-file (standard error
+// by default) on exit, or at the end of the current item on SIGUSR1.  Both are
+// read once, in main; while they are off the hooks below cost a branch each.
+
+/// TimingPhases - Time the phases below, and every pass, with -time-passes.
+static bool TimingPhases = false;
+
+/// CountingStats - Keep the counters below with -stats.
+static bool CountingStats = false;
+
+/// Phase - What a thread is busy with.  Time is charged to the innermost phase,
+/// so that codegen does not include the function pipeline it runs, and is
+/// summed over threads: with -j or -pipeline the phases overlap.
+enum Phase { PH_None, PH_Lex, PH_Parse, PH_Codegen, PH_Optimize, PH_Materialize, NumPhases };
+
+static const char *const PhaseNames[NumPhases] = {
+        nullptr, "lex", "parse", "codegen", "optimize", "materialize"};
+
+static std::atomic<uint64_t> PhaseNanos[NumPhases];
+static thread_local Phase CurPhase = PH_None;
+static thread_local std::chrono::steady_clock::time_point PhaseStart;
+
+/// EnterPhase - Charge the time since the last switch to the current phase and
+/// make P current.  Returns the phase that was current.
+static Phase EnterPhase(Phase P)
+{
+    auto Now = std::chrono::steady_clock::now();
+    if (CurPhase != PH_None)
+        PhaseNanos[CurPhase].fetch_add(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(Now - PhaseStart).count(),
+                std::memory_order_relaxed);
+    PhaseStart = Now;
+    Phase Outer = CurPhase;
+    CurPhase = P;
+    return Outer;
+}
+
+/// PhaseRegion - Charge the lifetime of the object to a phase.
+class PhaseRegion
+{
+    Phase Outer = PH_None;
+
+public:
+    explicit PhaseRegion(Phase P)
+    {
+        if (TimingPhases)
+            Outer = EnterPhase(P);
+    }
+    ~PhaseRegion()
+    {
+        if (TimingPhases)
+            EnterPhase(Outer);
+    }
+    PhaseRegion(const PhaseRegion &) = delete;
+    PhaseRegion &operator=(const PhaseRegion &) = delete;
+};
+
+/// PassTiming - The time spent in one pass or analysis, not counting the passes
+/// and analyses it ran in turn, and how often it ran.
+struct PassTiming
+{
+    uint64_t Nanos = 0;
+    uint64_t Runs = 0;
+};
+
+static std::mutex PassTimingLock;
+static StringMap<PassTiming> PassTimings;
+
+/// Counter - What -stats counts: the tokens the parser consumed and the
+/// expression nodes it built, the bytes the AST arenas took from the heap, the
+/// IR instructions generated, before any optimisation, and the times the
+/// driver reclaimed memory to stay within -memory-budget.
+enum Counter {
+    CT_Tokens, CT_ASTNodes, CT_ArenaBytes, CT_IRInstructions, CT_Reclaims, NumCounters
+};
+
+static const char *const CounterNames[NumCounters] = {
+        "tokens", "ast_nodes", "arena_bytes", "ir_instructions", "memory_reclaims"};
+
+static std::atomic<uint64_t> Counters[NumCounters];
+
+static void AddToCounter(Counter C, uint64_t N)
+{
+    Counters[C].fetch_add(N, std::memory_order_relaxed);
+}
 
 /*---------------------------------------------------------------------------------
  * Parser
@@ -18,403 +582,5128 @@ enum Token
     tok_def = -2,
     tok_extern = -3,
 
-    // primary
-    tok_identifier = -4,
-    tok_number = -5,
-};
+    // primary
+    tok_identifier = -4,
+    tok_number = -5,
+    tok_malformed_number = -6,  // Such as "1.2.3" or "."
+
+    // control
+    tok_for = -7,
+    tok_in = -8,
+
+    // var definition
+    tok_var = -9,
+};
+
+/// SymbolID - A small integer naming an interned identifier.
+typedef uint32_t SymbolID;
+
+/// SymbolInterner - Maps every distinct identifier spelling to a SymbolID.  The
+/// spelling is copied once, into a shared character pool, the first time it is
+/// seen; later lookups hash the source bytes in place and allocate nothing.
+/// SymbolID 0 is always the empty name.
+///
+/// Neither spellings nor entries ever move once added, so while one thread
+/// interns new names, others may call getName on any SymbolID that has been
+/// handed to them.
+class SymbolInterner
+{
+    struct Entry
+    {
+        const char *Name;   // Into a slab of the pool
+        uint32_t Length;
+        uint32_t Hash;
+    };
+
+    // The pool: spellings are packed into slabs, which are never reallocated.
+    static const size_t SlabSize = 64 * 1024;
+    std::vector<std::unique_ptr<char[]>> Slabs;
+    char *SlabPtr = nullptr;
+    char *SlabEnd = nullptr;
+
+    // Entries, indexed by SymbolID, in segments twice as large as the one before:
+    // segment K holds IDs [MinSegment * (2^K - 1), MinSegment * (2^(K+1) - 1)).
+    static const unsigned MinSegmentLog2 = 8;
+    static const unsigned MaxSegments = 32 - MinSegmentLog2;
+    std::unique_ptr<Entry[]> Segments[MaxSegments];
+    uint32_t NumEntries = 0;
+
+    std::vector<uint32_t> Buckets;  // SymbolID + 1, or 0 for an empty bucket
+
+    static uint32_t hash(llvm::StringRef Name)
+    {
+        // FNV-1a.
+        uint32_t H = 2166136261u;
+        for (char C : Name)
+            H = (H ^ (unsigned char)C) * 16777619u;
+        return H;
+    }
+
+    Entry &getEntry(SymbolID ID) const
+    {
+        uint32_t V = (ID >> MinSegmentLog2) + 1;
+        unsigned K = llvm::Log2_32(V);
+        return Segments[K][ID - (((1u << K) - 1) << MinSegmentLog2)];
+    }
+
+    const char *copyName(llvm::StringRef Name)
+    {
+        if ((size_t)(SlabEnd - SlabPtr) < Name.size()) {
+            size_t Size = Name.size() > SlabSize ? Name.size() : SlabSize;
+            Slabs.emplace_back(new char[Size]);
+            SlabPtr = Slabs.back().get();
+            SlabEnd = SlabPtr + Size;
+        }
+        char *Copy = SlabPtr;
+        std::copy(Name.begin(), Name.end(), Copy);
+        SlabPtr += Name.size();
+        return Copy;
+    }
+
+    void grow()
+    {
+        std::vector<uint32_t> NewBuckets(Buckets.size() * 2, 0);
+        size_t Mask = NewBuckets.size() - 1;
+        for (SymbolID ID = 0; ID != NumEntries; ++ID) {
+            size_t B = getEntry(ID).Hash & Mask;
+            while (NewBuckets[B])
+                B = (B + 1) & Mask;
+            NewBuckets[B] = ID + 1;
+        }
+        Buckets.swap(NewBuckets);
+    }
+
+public:
+    SymbolInterner() : Buckets(256, 0) { intern(""); }
+
+    /// intern - Return the SymbolID for Name, adding it if it is new.  Only one
+    /// thread may intern at a time.
+    SymbolID intern(llvm::StringRef Name)
+    {
+        uint32_t H = hash(Name);
+        size_t Mask = Buckets.size() - 1;
+        size_t B = H & Mask;
+        while (uint32_t Slot = Buckets[B]) {
+            const Entry &E = getEntry(Slot - 1);
+            if (E.Hash == H && getName(Slot - 1) == Name)
+                return Slot - 1;
+            B = (B + 1) & Mask;
+        }
+
+        SymbolID ID = NumEntries;
+        unsigned K = llvm::Log2_32((ID >> MinSegmentLog2) + 1);
+        if (ID == ((1u << K) - 1) << MinSegmentLog2)
+            Segments[K].reset(new Entry[(size_t)1 << (K + MinSegmentLog2)]);
+        getEntry(ID) = {copyName(Name), (uint32_t)Name.size(), H};
+        ++NumEntries;
+        Buckets[B] = ID + 1;
+        if (NumEntries * 2 > Buckets.size())
+            grow();
+        return ID;
+    }
+
+    /// getName - The spelling of an interned identifier, valid for as long as
+    /// the interner.
+    llvm::StringRef getName(SymbolID ID) const
+    {
+        const Entry &E = getEntry(ID);
+        return llvm::StringRef(E.Name, E.Length);
+    }
+
+    size_t size() const { return NumEntries; }
+};
+
+/// SymbolCache - One thread's way into a SymbolInterner that several threads
+/// intern into at once.  Names are interned into a private interner first, and
+/// only the first time this thread sees a name does it take Lock and intern it
+/// into the shared one; after that, the name costs what it would unshared.
+class SymbolCache
+{
+    SymbolInterner &Shared;
+    std::mutex &Lock;
+    SymbolInterner Local;
+    std::vector<SymbolID> ToShared;     // Indexed by local SymbolID
+
+public:
+    SymbolCache(SymbolInterner &Shared, std::mutex &Lock)
+            : Shared(Shared), Lock(Lock), ToShared(1, 0) {}
+
+    SymbolInterner &getShared() { return Shared; }
+
+    /// intern - Return the shared SymbolID for Name, adding it if it is new.
+    SymbolID intern(llvm::StringRef Name)
+    {
+        SymbolID ID = Local.intern(Name);
+        if (ID < ToShared.size())
+            return ToShared[ID];
+        std::lock_guard<std::mutex> Guard(Lock);
+        ToShared.push_back(Shared.intern(Name));
+        return ToShared.back();
+    }
+};
+
+/// SourceRange - A zero-copy view of a token: its offset and length in the
+/// source buffer.
+struct SourceRange
+{
+    size_t Offset;
+    uint32_t Length;
+};
+
+/// Backoff - Wait a little longer each time a thread finds a queue it is using
+/// empty or full: spin at first, then yield, then sleep, so that a pipeline
+/// waiting on an idle REPL does not keep the CPU busy.
+static void Backoff(unsigned &Spins)
+{
+    if (++Spins < 64)
+        return;
+    if (Spins < 128)
+        std::this_thread::yield();
+    else
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+}
+
+/// SPSCQueue - A lock-free ring of N (a power of two) elements, for exactly one
+/// producer thread and one consumer thread.  Each side keeps its own index in a
+/// cache line of its own, with a copy of the other side's that it only reloads
+/// when the ring looks full or empty.
+template <typename T, size_t N>
+class SPSCQueue
+{
+    static_assert((N & (N - 1)) == 0, "the size must be a power of two");
+
+    alignas(64) std::atomic<size_t> Head{0};  // Next to pop; written by the consumer
+    size_t CachedTail = 0;
+    alignas(64) std::atomic<size_t> Tail{0};  // Next to push; written by the producer
+    size_t CachedHead = 0;
+    alignas(64) T Slots[N];
+
+public:
+    bool tryPush(const T &V)
+    {
+        size_t T0 = Tail.load(std::memory_order_relaxed);
+        if (T0 - CachedHead == N) {
+            CachedHead = Head.load(std::memory_order_acquire);
+            if (T0 - CachedHead == N)
+                return false;
+        }
+        Slots[T0 & (N - 1)] = V;
+        Tail.store(T0 + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool tryPop(T &V)
+    {
+        size_t H0 = Head.load(std::memory_order_relaxed);
+        if (H0 == CachedTail) {
+            CachedTail = Tail.load(std::memory_order_acquire);
+            if (H0 == CachedTail)
+                return false;
+        }
+        V = Slots[H0 & (N - 1)];
+        Head.store(H0 + 1, std::memory_order_release);
+        return true;
+    }
+
+    void push(const T &V)
+    {
+        for (unsigned Spins = 0; !tryPush(V);)
+            Backoff(Spins);
+    }
+
+    T pop()
+    {
+        T V;
+        for (unsigned Spins = 0; !tryPop(V);)
+            Backoff(Spins);
+        return V;
+    }
+};
+
+/// LexedToken - A token and everything the lexer filled in for it, as passed
+/// from a lexer thread to a parser thread.
+struct LexedToken
+{
+    int Kind;
+    SymbolID Identifier;
+    double NumVal;
+    SourceRange Range;
+};
+
+typedef SPSCQueue<LexedToken, 4096> TokenRing;
+
+/// MinPowerOf5/MaxPowerOf5 - The range of decimal exponents Eisel-Lemire has a
+/// table entry for.  Anything smaller underflows to zero and anything larger
+/// overflows to infinity, for any mantissa of up to 19 digits.
+static const int MinPowerOf5 = -342;
+static const int MaxPowerOf5 = 308;
+
+/// getPowersOf5 - For each Q from MinPowerOf5 to MaxPowerOf5, the 128 most
+/// significant bits of 5^Q as a (high, low) pair, normalised so that the top
+/// bit is set: truncated for Q >= 0 and rounded up for Q < 0, so that
+/// multiplying by them never overshoots the exact product by more than Eisel
+/// and Lemire's error bound.  Built with APInt the first time it is needed.
+static const std::pair<uint64_t, uint64_t> *getPowersOf5()
+{
+    static const std::vector<std::pair<uint64_t, uint64_t>> Table = [] {
+        const unsigned Bits = 2048;
+        std::vector<std::pair<uint64_t, uint64_t>> T(MaxPowerOf5 - MinPowerOf5 + 1);
+        auto Store = [&](int Q, APInt C) {
+            unsigned Active = C.getActiveBits();
+            C = Active > 128 ? C.lshr(Active - 128) : C.shl(128 - Active);
+            T[Q - MinPowerOf5] = {C.extractBitsAsZExtValue(64, 64),
+                                  C.extractBitsAsZExtValue(64, 0)};
+        };
+
+        APInt P(Bits, 1);
+        for (int Q = 0; Q <= MaxPowerOf5; ++Q, P *= 5)
+            Store(Q, P);
+
+        P = APInt(Bits, 1);
+        for (int Q = -1; Q >= MinPowerOf5; --Q) {
+            P *= 5;
+            // Enough bits of 2^B / 5^-Q that the quotient keeps 128 of them.
+            unsigned Z = P.ceilLogBase2();
+            unsigned B = Q >= -27 ? Z + 127 : 2 * Z + 128;
+            Store(Q, APInt::getOneBitSet(Bits, B).udiv(P) + 1);
+        }
+        return T;
+    }();
+    return Table.data();
+}
+
+/// EiselLemire - Round W * 10^Q, where W is nonzero and has at most 19 digits,
+/// to the nearest double, ties to even.  Returns false in the rare case that
+/// the 128-bit product is too close to a tie to tell which way to round.
+static bool EiselLemire(uint64_t W, int Q, double &Result)
+{
+    if (Q < MinPowerOf5) {
+        Result = 0;
+        return true;
+    }
+    if (Q > MaxPowerOf5) {
+        Result = std::numeric_limits<double>::infinity();
+        return true;
+    }
+
+    // Multiply the normalised mantissa by the top 64 bits of 5^Q, and by the
+    // next 64 only if the top 55 bits of the product could still change.
+    unsigned LZ = countLeadingZeros(W);
+    W <<= LZ;
+    const std::pair<uint64_t, uint64_t> &P5 = getPowersOf5()[Q - MinPowerOf5];
+    unsigned __int128 Product = (unsigned __int128)W * P5.first;
+    uint64_t Hi = Product >> 64, Lo = (uint64_t)Product;
+    const uint64_t PrecisionMask = ~uint64_t(0) >> 55;
+    if ((Hi & PrecisionMask) == PrecisionMask) {
+        uint64_t Next = ((unsigned __int128)W * P5.second) >> 64;
+        Lo += Next;
+        Hi += Next > Lo;
+    }
+    if (Lo == ~uint64_t(0) && (Q < -27 || Q > 55))
+        return false;
+
+    // Take 54 bits (one more than a double has, to round with) and work out
+    // the biased binary exponent: 217706 / 2^16 approximates log2(10).
+    unsigned UpperBit = Hi >> 63;
+    uint64_t Mantissa = Hi >> (UpperBit + 9);
+    int Power2 = ((217706 * Q) >> 16) + 63 + (int)UpperBit - (int)LZ + 1023;
+
+    if (Power2 <= 0) {
+        // A subnormal, or zero.
+        if (-Power2 + 1 >= 64) {
+            Result = 0;
+            return true;
+        }
+        Mantissa >>= -Power2 + 1;
+        Mantissa += Mantissa & 1;
+        Mantissa >>= 1;
+        Power2 = Mantissa < (uint64_t(1) << 52) ? 0 : 1;
+        Result = BitsToDouble(Mantissa | (uint64_t)Power2 << 52);
+        return true;
+    }
+
+    // An exact tie can only happen for small Q; round it to even.
+    if (Lo <= 1 && Q >= -4 && Q <= 23 && (Mantissa & 3) == 1 &&
+        (Mantissa << (UpperBit + 9)) == Hi)
+        Mantissa &= ~uint64_t(1);
+    Mantissa += Mantissa & 1;
+    Mantissa >>= 1;
+    if (Mantissa >= (uint64_t(2) << 52)) {
+        Mantissa = uint64_t(1) << 52;
+        ++Power2;
+    }
+    Mantissa &= ~(uint64_t(1) << 52);
+    if (Power2 >= 0x7FF) {
+        Result = std::numeric_limits<double>::infinity();
+        return true;
+    }
+    Result = BitsToDouble(Mantissa | (uint64_t)Power2 << 52);
+    return true;
+}
+
+/// ParseDecimal - Convert Text, of the form [0-9]*('.'[0-9]*)? with at least one
+/// digit, to the nearest double, bit for bit as strtod would.  Returns false if
+/// Text has no digits or more than one '.'.
+///
+/// Up to 19 significant digits with a power of ten no larger than 10^22 take
+/// the fast path: the mantissa and the power are then both exact doubles, so
+/// one multiplication or division rounds correctly.  Other values of up to 19
+/// digits go through Eisel-Lemire.  Longer ones are rare and left to APFloat,
+/// which rounds every decimal string correctly.
+static bool ParseDecimal(llvm::StringRef Text, double &Result)
+{
+    static const double PowersOf10[] = {
+            1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+    uint64_t Mantissa = 0;  // The value is Mantissa * 10^Exponent, if Exact
+    int Exponent = 0;
+    unsigned NumDigits = 0; // Significant digits in Mantissa
+    bool Exact = true;      // No nonzero digit was left out of Mantissa
+    bool SawDigit = false, SawDot = false;
+    for (char C : Text) {
+        if (C == '.') {
+            if (SawDot)
+                return false;
+            SawDot = true;
+            continue;
+        }
+        SawDigit = true;
+        unsigned Digit = C - '0';
+        if (NumDigits < 19) {
+            Mantissa = Mantissa * 10 + Digit;
+            NumDigits += Mantissa != 0;
+            Exponent -= SawDot;
+        } else {
+            Exponent += !SawDot;
+            Exact &= Digit == 0;
+        }
+    }
+    if (!SawDigit)
+        return false;
+
+    if (Exact) {
+        if (Mantissa <= (uint64_t(1) << 53) && Exponent >= -22 && Exponent <= 22) {
+            double M = (double)Mantissa;
+            Result = Exponent < 0 ? M / PowersOf10[-Exponent] : M * PowersOf10[Exponent];
+            return true;
+        }
+        if (Mantissa == 0) {
+            Result = 0;
+            return true;
+        }
+        if (EiselLemire(Mantissa, Exponent, Result))
+            return true;
+    }
+
+    APFloat V(APFloat::IEEEdouble());
+    auto Status = V.convertFromString(Text, APFloat::rmNearestTiesToEven);
+    if (!Status) {
+        consumeError(Status.takeError());
+        return false;
+    }
+    Result = V.convertToDouble();
+    return true;
+}
+
+/// Keyword - A reserved word and the token the lexer returns for it.
+struct Keyword
+{
+    const char *Spelling;
+    size_t Length;
+    int Kind;
+};
+
+/// Keywords - Every reserved word in the language.
+static constexpr Keyword Keywords[] = {
+    {"def", 3, tok_def},
+    {"extern", 6, tok_extern},
+    {"for", 3, tok_for},
+    {"in", 2, tok_in},
+    {"var", 3, tok_var},
+};
+
+/// KeywordHash - A hash of an identifier's length and its first and last
+/// letters.  Over the keywords in the language it is perfect, which is checked
+/// below; the constants also keep the words the language is likely to reserve
+/// (if, then, else, binary, unary) in slots of their own.
+constexpr unsigned KeywordHash(const char *S, size_t Length)
+{
+    return (2 * Length + (unsigned char)S[0] + (unsigned char)S[Length - 1]) & 31;
+}
+
+/// KeywordTable - Keywords indexed by KeywordHash plus one, with 0 for a slot
+/// no keyword hashes to.
+struct KeywordTable
+{
+    uint8_t Slots[32] = {};
+    size_t MaxLength = 0;
+    bool Perfect = true;
+
+    constexpr KeywordTable()
+    {
+        for (size_t I = 0; I != sizeof(Keywords) / sizeof(Keywords[0]); ++I) {
+            unsigned H = KeywordHash(Keywords[I].Spelling, Keywords[I].Length);
+            Perfect &= Slots[H] == 0;
+            Slots[H] = I + 1;
+            if (Keywords[I].Length > MaxLength)
+                MaxLength = Keywords[I].Length;
+        }
+    }
+};
+
+static constexpr KeywordTable TheKeywordTable;
+static_assert(TheKeywordTable.Perfect, "two keywords share a KeywordHash slot");
+
+/// ClassifyIdentifier - The token for the identifier Text: its keyword's, or
+/// tok_identifier.  One hash and at most one comparison, however many keywords
+/// there are.
+static inline int ClassifyIdentifier(llvm::StringRef Text)
+{
+    if (Text.size() > TheKeywordTable.MaxLength)
+        return tok_identifier;
+    unsigned Slot = TheKeywordTable.Slots[KeywordHash(Text.data(), Text.size())];
+    if (Slot == 0)
+        return tok_identifier;
+    const Keyword &K = Keywords[Slot - 1];
+    if (K.Length != Text.size() || memcmp(K.Spelling, Text.data(), K.Length) != 0)
+        return tok_identifier;
+    return K.Kind;
+}
+
+/// Lexer - Turns a source buffer into tokens.  All of its state lives in the
+/// object, so independent lexers can run side by side on different threads as
+/// long as each has an interner of its own.  A lexer made from a TokenRing
+/// instead replays the tokens that a lexer on another thread pushes into it.
+class Lexer
+{
+    SymbolInterner &Symbols;
+    SymbolCache *Cache = nullptr;   // Interns into Symbols, if it is shared
+    SourceBuffer *CurBuf = nullptr; // The input being lexed
+    const char *CurPtr = nullptr;   // Next unlexed character in CurBuf
+    TokenRing *Replay = nullptr;    // Or the ring tokens are taken from
+
+    SourceRange TokRange = {0, 0};  // Filled in for every token
+    SymbolID IdentifierSym = 0;     // Filled in if tok_identifier
+    double NumVal = 0;              // Filled in if tok_number
+
+public:
+    Lexer(SymbolInterner &Symbols, SourceBuffer &SB)
+            : Symbols(Symbols), CurBuf(&SB), CurPtr(SB.begin()) {}
+    Lexer(SymbolInterner &Symbols, TokenRing &Ring) : Symbols(Symbols), Replay(&Ring) {}
+    Lexer(SymbolCache &Cache, SourceBuffer &SB)
+            : Symbols(Cache.getShared()), Cache(&Cache), CurBuf(&SB), CurPtr(SB.begin()) {}
+
+    SymbolInterner &getSymbols() { return Symbols; }
+
+    /// intern - Return the SymbolID for Name in the interner of this lexer's
+    /// identifiers.
+    SymbolID intern(llvm::StringRef Name)
+    {
+        return Cache ? Cache->intern(Name) : Symbols.intern(Name);
+    }
+    SourceRange getTokRange() const { return TokRange; }
+    SymbolID getIdentifier() const { return IdentifierSym; }
+    double getNumVal() const { return NumVal; }
+
+    /// gettok - Return the next token from the source buffer.
+    int gettok()
+    {
+        if (Replay) {
+            LexedToken T = Replay->pop();
+            TokRange = T.Range;
+            IdentifierSym = T.Identifier;
+            NumVal = T.NumVal;
+            return T.Kind;
+        }
+        PhaseRegion Region(PH_Lex);
+        return lexToken();
+    }
+
+private:
+    int lexToken()
+    {
+        while (true) {
+            // Skips any whitespace
+            CurPtr = SkipWhitespace(CurPtr);
+
+            if (*CurPtr == '#') {
+                // Comment until end of line.
+                CurPtr = SkipToLineEnd(CurPtr + 1);
+                continue;
+            }
+
+            // Check for the end of the buffer.  Don't eat the EOF.
+            if (CurPtr == CurBuf->end()) {
+                if (!CurBuf->refill())
+                    return tok_eof;
+                CurPtr = CurBuf->begin();
+                continue;
+            }
+            break;
+        }
+
+        const char *TokStart = CurPtr;
+        TokRange.Offset = CurBuf->getOffset(TokStart);
+        if (isalpha((unsigned char)*CurPtr)) { // identifier: [a-zA-Z][a-zA-Z0-9]*
+            while (isalnum((unsigned char)*++CurPtr))
+                ;
+            TokRange.Length = CurPtr - TokStart;
+            llvm::StringRef Text(TokStart, TokRange.Length);
+
+            int Kind = ClassifyIdentifier(Text);
+            if (Kind == tok_identifier)
+                IdentifierSym = intern(Text);
+            return Kind;
+        }
+
+        if (isdigit((unsigned char)*CurPtr) || *CurPtr == '.') {  // Number: [0-9.]+
+            do
+                ++CurPtr;
+            while (isdigit((unsigned char)*CurPtr) || *CurPtr == '.');
+            TokRange.Length = CurPtr - TokStart;
+            if (!ParseDecimal(llvm::StringRef(TokStart, TokRange.Length), NumVal))
+                return tok_malformed_number;
+            return tok_number;
+        }
+
+        // Otherwise, just return the character as its ascii value.
+        TokRange.Length = 1;
+        return (unsigned char)*CurPtr++;
+    }
+};
+/*-------------------------------------------------------------------------------
+ * AST -- Abstract Syntax Tree (Parse Tree)
+ *------------------------------------------------------------------------------*/
+/// ASTArena - Bump-pointer allocator that owns the whole AST of a top-level item.
+/// Nodes are carved out of large slabs and are never destroyed one by one, so they
+/// must not own heap memory themselves: children are plain pointers and lists
+/// are copied into the arena.  reset() releases everything in O(1) and keeps the
+/// slabs around for the next item.
+class ASTArena
+{
+    static const size_t SlabSize = 64 * 1024;
+
+    std::vector<std::unique_ptr<char[]>> Slabs;
+    std::vector<std::unique_ptr<char[]>> LargeAllocs;   // Bigger than a slab
+    size_t CurSlab = 0;
+    char *Ptr = nullptr;
+    char *End = nullptr;
+
+    void *allocateSlow(size_t Size, size_t Align)
+    {
+        if (Size + Align > SlabSize) {
+            if (CountingStats)
+                AddToCounter(CT_ArenaBytes, Size + Align);
+            LargeAllocs.emplace_back(new char[Size + Align]);
+            return alignPtr(LargeAllocs.back().get(), Align);
+        }
+        // Move on to the next slab, reusing one kept from before the last
+        // reset() if there is one.
+        if (!Ptr || ++CurSlab == Slabs.size()) {
+            CurSlab = Slabs.size();
+            if (CountingStats)
+                AddToCounter(CT_ArenaBytes, SlabSize);
+            Slabs.emplace_back(new char[SlabSize]);
+        }
+        Ptr = alignPtr(Slabs[CurSlab].get(), Align);
+        End = Slabs[CurSlab].get() + SlabSize;
+        void *Result = Ptr;
+        Ptr += Size;
+        return Result;
+    }
+
+    static char *alignPtr(char *P, size_t Align)
+    {
+        return (char *)(((uintptr_t)P + Align - 1) & ~(uintptr_t)(Align - 1));
+    }
+
+public:
+    ASTArena() = default;
+    ASTArena(const ASTArena &) = delete;
+    ASTArena &operator=(const ASTArena &) = delete;
+
+    void *allocate(size_t Size, size_t Align)
+    {
+        char *P = alignPtr(Ptr, Align);
+        if (Ptr && P + Size <= End) {
+            Ptr = P + Size;
+            return P;
+        }
+        return allocateSlow(Size, Align);
+    }
+
+    /// create - Construct a T in the arena.  Its destructor will never run.
+    template <typename T, typename... ArgTs>
+    T *create(ArgTs &&... Args)
+    {
+        return new (allocate(sizeof(T), alignof(T))) T(std::forward<ArgTs>(Args)...);
+    }
+
+    /// copy - Copy a list of trivially copyable elements into the arena.
+    template <typename T>
+    llvm::ArrayRef<T> copy(llvm::ArrayRef<T> Elts)
+    {
+        if (Elts.empty())
+            return llvm::ArrayRef<T>();
+        T *Mem = static_cast<T *>(allocate(sizeof(T) * Elts.size(), alignof(T)));
+        std::memcpy(Mem, Elts.data(), sizeof(T) * Elts.size());
+        return llvm::ArrayRef<T>(Mem, Elts.size());
+    }
+
+    /// reset - Free every node at once, keeping the first slabs for reuse.
+    void reset()
+    {
+        LargeAllocs.clear();
+        CurSlab = 0;
+        Ptr = Slabs.empty() ? nullptr : Slabs[0].get();
+        End = Slabs.empty() ? nullptr : Slabs[0].get() + SlabSize;
+    }
+
+    /// shrink - reset, and give back every slab but the first, which an item
+    /// far larger than the rest would otherwise keep for good.
+    void shrink()
+    {
+        if (Slabs.size() > 1)
+            Slabs.resize(1);
+        reset();
+    }
+};
+
+/// ItemArena - Holds the AST of the top-level item currently being handled.
+static ASTArena ItemArena;
+
+/// ExprAST - Base class for all expression nodes.  Nodes never change once
+/// built, so with hash-consing one node may stand for several identical
+/// subexpressions.
+class ExprAST 
+{
+public:
+    enum ExprKind { EK_Number, EK_Variable, EK_Binary, EK_Call, EK_For, EK_Var };
+
+private:
+    const ExprKind Kind;
+    bool Pure;              // No calls, loops or assignments anywhere in the subtree
+    bool Reused = false;    // Hash-consing handed this node out again
+
+public:
+    ExprAST(ExprKind Kind, bool Pure) : Kind(Kind), Pure(Pure) {}
+    virtual ~ExprAST() = default;
+    virtual Value *codegen() = 0;
+
+    ExprKind getKind() const { return Kind; }
+    bool isPure() const { return Pure; }
+
+    /// isShared - Whether this node is reused and has no calls, so that code
+    /// generated for it once can stand for every occurrence.
+    bool isShared() const { return Reused && Pure; }
+    void markReused() { Reused = true; }
+};
+
+/// NumberExprAST - Expression class for numeric literals like "1.0".
+class NumberExprAST : public ExprAST 
+{
+    double Val;
+public:
+    NumberExprAST(double val) : ExprAST(EK_Number, true), Val(val) {}
+    Value *codegen() override;
+    double getVal() const { return Val; }
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Number; }
+};
+
+/// VariableExprAST - Expression class for referencing a variable, like "a".
+class VariableExprAST : public ExprAST 
+{
+    SymbolID Name;
+public:
+    VariableExprAST(SymbolID name) : ExprAST(EK_Variable, true), Name(name) {}
+    Value *codegen() override;
+    SymbolID getName() const { return Name; }
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Variable; }
+};
+
+/// BinaryExprAST - Expression class for a binary operator.  Op '=' assigns RHS
+/// to the variable LHS.
+class BinaryExprAST : public ExprAST 
+{
+    char Op;
+    ExprAST *LHS, *RHS;
+public:
+    BinaryExprAST(char Op, ExprAST *LHS, ExprAST *RHS)
+            : ExprAST(EK_Binary, Op != '=' && LHS->isPure() && RHS->isPure()),
+              Op(Op), LHS(LHS), RHS(RHS) {}
+    Value *codegen() override;
+    char getOp() const { return Op; }
+    ExprAST *getLHS() const { return LHS; }
+    ExprAST *getRHS() const { return RHS; }
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Binary; }
+};
+
+/// CallExprAST - Expression class for function calls.
+class CallExprAST : public ExprAST 
+{
+    SymbolID Callee;
+    llvm::ArrayRef<ExprAST *> Args;     // Stored in the same arena
+public:
+    CallExprAST(SymbolID Callee, llvm::ArrayRef<ExprAST *> Args)
+            : ExprAST(EK_Call, false), Callee(Callee), Args(Args) {}
+    Value *codegen() override;
+    SymbolID getCallee() const { return Callee; }
+    llvm::ArrayRef<ExprAST *> getArgs() const { return Args; }
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Call; }
+};
+
+/// ForExprAST - Expression class for for/in.
+class ForExprAST : public ExprAST
+{
+    SymbolID VarName;
+    ExprAST *Start, *End, *Step, *Body;  // Step is null for the default of 1.0
+public:
+    ForExprAST(SymbolID VarName, ExprAST *Start, ExprAST *End, ExprAST *Step,
+               ExprAST *Body)
+            : ExprAST(EK_For, false), VarName(VarName), Start(Start), End(End),
+              Step(Step), Body(Body) {}
+    Value *codegen() override;
+    SymbolID getVarName() const { return VarName; }
+    ExprAST *getStart() const { return Start; }
+    ExprAST *getEnd() const { return End; }
+    ExprAST *getStep() const { return Step; }
+    ExprAST *getBody() const { return Body; }
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_For; }
+};
+
+/// VarBinding - One name introduced by var/in, and its initializer (null for
+/// the default of 0.0).
+struct VarBinding
+{
+    SymbolID Name;
+    ExprAST *Init;
+};
+
+/// VarExprAST - Expression class for var/in.
+class VarExprAST : public ExprAST
+{
+    llvm::ArrayRef<VarBinding> Vars;    // Stored in the same arena
+    ExprAST *Body;
+public:
+    VarExprAST(llvm::ArrayRef<VarBinding> Vars, ExprAST *Body)
+            : ExprAST(EK_Var, false), Vars(Vars), Body(Body) {}
+    Value *codegen() override;
+    llvm::ArrayRef<VarBinding> getVars() const { return Vars; }
+    ExprAST *getBody() const { return Body; }
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Var; }
+};
+
+/// PrototypeAST - This class represents the "prototype" for a function,
+/// which captures its name, and its argument names (thus implicitly the number
+/// of arguments the function takes).
+class PrototypeAST 
+{
+    SymbolID Name;
+    llvm::ArrayRef<SymbolID> Args;      // Stored in the same arena
+    bool Extern;                        // Declared by extern, for the host
+
+public:
+    PrototypeAST(SymbolID Name, llvm::ArrayRef<SymbolID> Args, bool Extern = false)
+            : Name(Name), Args(Args), Extern(Extern) {}
+
+    Function *codegen();
+    SymbolID getName() { return Name; }
+    llvm::ArrayRef<SymbolID> getArgs() { return Args; }
+    bool isExtern() const { return Extern; }
+};
+
+/// FunctionAST - This class represents a function definition itself.
+class FunctionAST 
+{
+    PrototypeAST *Proto;
+    ExprAST *Body;
+    llvm::ArrayRef<SymbolID> Assigned;  // Every name Body assigns to with '='
+
+public:
+    FunctionAST(PrototypeAST *Proto, ExprAST *Body, llvm::ArrayRef<SymbolID> Assigned)
+            : Proto(Proto), Body(Body), Assigned(Assigned) {}
+    Function *codegen();
+    PrototypeAST &getProto() { return *Proto; }
+    ExprAST *getBody() { return Body; }
+
+    /// isAssigned - Whether the body assigns to the argument or variable Name,
+    /// which then needs a stack slot rather than a single SSA value.
+    bool isAssigned(SymbolID Name) const { return llvm::is_contained(Assigned, Name); }
+    llvm::ArrayRef<SymbolID> getAssigned() const { return Assigned; }
+};
+
+/// ExprUniquer - Hash-conses expression nodes: asked for a node equal to one it
+/// has already built, it returns that one instead of allocating another, so
+/// identical subtrees collapse into a DAG.  Children are themselves unique, so
+/// two nodes are equal exactly when their fields and child pointers are.
+class ExprUniquer
+{
+    struct Slot
+    {
+        uint32_t Hash;
+        ExprAST *Node;      // Null for an empty bucket
+    };
+
+    std::vector<Slot> Buckets;
+    size_t NumNodes = 0;
+
+    static uint32_t mix(uint32_t H, uint64_t V)
+    {
+        // FNV-1a over the bytes of V.
+        for (unsigned I = 0; I != 8; ++I, V >>= 8)
+            H = (H ^ (uint8_t)V) * 16777619u;
+        return H;
+    }
+    static uint32_t hashKind(ExprAST::ExprKind K) { return mix(2166136261u, K); }
+    static uint64_t bitsOf(double D)
+    {
+        uint64_t Bits;
+        std::memcpy(&Bits, &D, sizeof(D));
+        return Bits;
+    }
+
+    void grow()
+    {
+        std::vector<Slot> NewBuckets(Buckets.size() * 2, Slot{0, nullptr});
+        size_t Mask = NewBuckets.size() - 1;
+        for (const Slot &S : Buckets) {
+            if (!S.Node)
+                continue;
+            size_t B = S.Hash & Mask;
+            while (NewBuckets[B].Node)
+                B = (B + 1) & Mask;
+            NewBuckets[B] = S;
+        }
+        Buckets.swap(NewBuckets);
+    }
+
+    /// getOrCreate - The node with hash H that satisfies Matches, or the one
+    /// Create builds if there is none yet.
+    template <typename T, typename MatchFn, typename CreateFn>
+    T *getOrCreate(uint32_t H, MatchFn Matches, CreateFn Create)
+    {
+        size_t Mask = Buckets.size() - 1;
+        size_t B = H & Mask;
+        for (; Buckets[B].Node; B = (B + 1) & Mask) {
+            if (Buckets[B].Hash != H)
+                continue;
+            auto *Node = llvm::dyn_cast<T>(Buckets[B].Node);
+            if (Node && Matches(*Node)) {
+                Node->markReused();
+                return Node;
+            }
+        }
+
+        T *Node = Create();
+        Buckets[B] = Slot{H, Node};
+        if (++NumNodes * 2 > Buckets.size())
+            grow();
+        return Node;
+    }
+
+public:
+    ExprUniquer() : Buckets(256, Slot{0, nullptr}) {}
+
+    /// clear - Forget every node, e.g. because the arena holding them is reset.
+    void clear()
+    {
+        if (NumNodes)
+            std::fill(Buckets.begin(), Buckets.end(), Slot{0, nullptr});
+        NumNodes = 0;
+    }
+
+    NumberExprAST *getNumber(ASTArena &Arena, double Val)
+    {
+        uint64_t Bits = bitsOf(Val);
+        return getOrCreate<NumberExprAST>(
+                mix(hashKind(ExprAST::EK_Number), Bits),
+                [&](NumberExprAST &E) { return bitsOf(E.getVal()) == Bits; },
+                [&] { return Arena.create<NumberExprAST>(Val); });
+    }
+
+    VariableExprAST *getVariable(ASTArena &Arena, SymbolID Name)
+    {
+        return getOrCreate<VariableExprAST>(
+                mix(hashKind(ExprAST::EK_Variable), Name),
+                [&](VariableExprAST &E) { return E.getName() == Name; },
+                [&] { return Arena.create<VariableExprAST>(Name); });
+    }
+
+    BinaryExprAST *getBinary(ASTArena &Arena, char Op, ExprAST *LHS, ExprAST *RHS)
+    {
+        uint32_t H = mix(mix(mix(hashKind(ExprAST::EK_Binary), Op), (uintptr_t)LHS),
+                         (uintptr_t)RHS);
+        return getOrCreate<BinaryExprAST>(
+                H,
+                [&](BinaryExprAST &E) {
+                    return E.getOp() == Op && E.getLHS() == LHS && E.getRHS() == RHS;
+                },
+                [&] { return Arena.create<BinaryExprAST>(Op, LHS, RHS); });
+    }
+
+    /// getCall - Args need not be in the arena; they are copied there only if
+    /// the call is new.
+    CallExprAST *getCall(ASTArena &Arena, SymbolID Callee, llvm::ArrayRef<ExprAST *> Args)
+    {
+        uint32_t H = mix(hashKind(ExprAST::EK_Call), Callee);
+        for (ExprAST *Arg : Args)
+            H = mix(H, (uintptr_t)Arg);
+        return getOrCreate<CallExprAST>(
+                H,
+                [&](CallExprAST &E) { return E.getCallee() == Callee && E.getArgs() == Args; },
+                [&] { return Arena.create<CallExprAST>(Callee, Arena.copy(Args)); });
+    }
+};
+
+/// FlatExpr - An expression laid out as parallel arrays of nodes, indexed by
+/// number rather than linked by pointer, in post-order: every node comes after
+/// its operands and the root is last, so a pass over the expression is one loop
+/// from front to back with no recursion and no virtual calls.  What each node's
+/// A and B hold depends on its kind:
+///
+///   EK_Number     A indexes Numbers
+///   EK_Variable   A is the SymbolID
+///   EK_Binary     A and B are the operand nodes, Ops the operator
+///   EK_Call       A indexes Calls
+///
+/// A shared node of a hash-consed tree is laid out once, and every parent refers
+/// to it; every other node is laid out once per occurrence.  The ExprAST
+/// classes remain the parser's view of the same expression.
+class FlatExpr
+{
+public:
+    /// FlatCall - A call's callee and arguments.  Start is the first node laid
+    /// out for its subtree: a tree walk would reach the call, and resolve its
+    /// callee, just before that node.  Calls are in that order.
+    struct FlatCall
+    {
+        SymbolID Callee;
+        uint32_t Start;
+        uint32_t ArgsBegin;     // Its argument nodes in ArgNodes
+        uint32_t NumArgs;
+    };
+
+    std::vector<uint8_t> Kinds;
+    std::vector<char> Ops;
+    std::vector<uint32_t> A, B;
+    std::vector<double> Numbers;
+    std::vector<FlatCall> Calls;
+    std::vector<uint32_t> ArgNodes;
+
+    size_t size() const { return Kinds.size(); }
+    ExprAST::ExprKind getKind(uint32_t Node) const { return (ExprAST::ExprKind)Kinds[Node]; }
+    ArrayRef<uint32_t> getArgs(const FlatCall &C) const
+    {
+        return makeArrayRef(ArgNodes).slice(C.ArgsBegin, C.NumArgs);
+    }
+
+    /// assign - Lay out the expression under Root, replacing what was here.
+    /// The arrays keep their capacity, so a FlatExpr reused for one function
+    /// after another stops allocating once it has seen the largest.  Returns
+    /// false, leaving the FlatExpr unusable, if it has a loop, a var or an
+    /// assignment: the layout only holds straight-line expressions.
+    bool assign(ExprAST *Root);
+
+private:
+    /// Frame - A node being laid out: how many operands have been visited, and
+    /// for a call, its entry in Calls.
+    struct Frame
+    {
+        ExprAST *E;
+        unsigned Next;
+        uint32_t Call;
+    };
+    std::vector<Frame> Pending;
+    std::vector<uint32_t> Done;         // The nodes of finished operands
+    DenseMap<const ExprAST *, uint32_t> SharedNodes;
+
+    uint32_t addNode(ExprAST::ExprKind Kind, char Op, uint32_t NodeA, uint32_t NodeB)
+    {
+        Kinds.push_back(Kind);
+        Ops.push_back(Op);
+        A.push_back(NodeA);
+        B.push_back(NodeB);
+        return Kinds.size() - 1;
+    }
+};
+
+bool FlatExpr::assign(ExprAST *Root)
+{
+    Kinds.clear();
+    Ops.clear();
+    A.clear();
+    B.clear();
+    Numbers.clear();
+    Calls.clear();
+    ArgNodes.clear();
+    SharedNodes.clear();
+
+    // Walk the tree with an explicit stack, laying each node out once all of
+    // its operands are.
+    Pending.push_back({Root, 0, 0});
+    while (!Pending.empty()) {
+        Frame &Top = Pending.back();
+        ExprAST *E = Top.E;
+        if (Top.Next == 0) {
+            if (E->isShared()) {
+                auto It = SharedNodes.find(E);
+                if (It != SharedNodes.end()) {
+                    Done.push_back(It->second);
+                    Pending.pop_back();
+                    continue;
+                }
+            }
+            auto *Bin = llvm::dyn_cast<BinaryExprAST>(E);
+            if (llvm::isa<ForExprAST>(E) || llvm::isa<VarExprAST>(E) ||
+                (Bin && Bin->getOp() == '=')) {
+                Pending.clear();
+                Done.clear();
+                return false;
+            }
+            if (auto *Call = llvm::dyn_cast<CallExprAST>(E)) {
+                Top.Call = Calls.size();
+                Calls.push_back({Call->getCallee(), (uint32_t)size(), 0,
+                                 (uint32_t)Call->getArgs().size()});
+            }
+        }
+
+        ExprAST *Operand = nullptr;
+        if (auto *Bin = llvm::dyn_cast<BinaryExprAST>(E)) {
+            if (Top.Next < 2)
+                Operand = Top.Next == 0 ? Bin->getLHS() : Bin->getRHS();
+        } else if (auto *Call = llvm::dyn_cast<CallExprAST>(E)) {
+            if (Top.Next < Call->getArgs().size())
+                Operand = Call->getArgs()[Top.Next];
+        }
+        if (Operand) {
+            ++Top.Next;
+            Pending.push_back({Operand, 0, 0});     // Top is not used past here
+            continue;
+        }
+
+        uint32_t Node;
+        switch (E->getKind()) {
+            case ExprAST::EK_Number:
+                Node = addNode(ExprAST::EK_Number, 0, Numbers.size(), 0);
+                Numbers.push_back(llvm::cast<NumberExprAST>(E)->getVal());
+                break;
+            case ExprAST::EK_Variable:
+                Node = addNode(ExprAST::EK_Variable, 0,
+                               llvm::cast<VariableExprAST>(E)->getName(), 0);
+                break;
+            case ExprAST::EK_Binary: {
+                uint32_t RHS = Done.back();
+                Done.pop_back();
+                uint32_t LHS = Done.back();
+                Done.pop_back();
+                Node = addNode(ExprAST::EK_Binary, llvm::cast<BinaryExprAST>(E)->getOp(),
+                               LHS, RHS);
+                break;
+            }
+            case ExprAST::EK_Call: {
+                FlatCall &C = Calls[Top.Call];
+                C.ArgsBegin = ArgNodes.size();
+                ArgNodes.insert(ArgNodes.end(), Done.end() - C.NumArgs, Done.end());
+                Done.resize(Done.size() - C.NumArgs);
+                Node = addNode(ExprAST::EK_Call, 0, Top.Call, 0);
+                break;
+            }
+            case ExprAST::EK_For:
+            case ExprAST::EK_Var:
+                llvm_unreachable("loops and vars are rejected on the way down");
+        }
+        if (E->isShared())
+            SharedNodes[E] = Node;
+        Done.push_back(Node);
+        Pending.pop_back();
+    }
+    Done.clear();
+    return true;
+}
+
+/*--------------------------------------------------------------------------------
+ * Parser
+ *------------------------------------------------------------------------------*/
+/// DeferredErrors - If set, where this thread's errors are collected instead of
+/// being printed, so that they can be printed in order with everything else.
+static thread_local std::string *DeferredErrors = nullptr;
+
+ExprAST *LogError(const char *Str)
+{
+    if (DeferredErrors)
+        *DeferredErrors += "Error, " + std::string(Str) + "\n";
+    else
+        fprintf(stderr, "Error, %s\n", Str);
+    return nullptr;
+}
+
+PrototypeAST *LogErrorP(const char *Str) 
+{
+    LogError(Str);
+    return nullptr;
+}
+
+/// Parser - Builds the AST of one top-level item at a time from a Lexer's
+/// tokens, allocating it in an arena.  Like the lexer, it keeps all of its
+/// state to itself, so every parse session gets its own Lexer, Parser,
+/// interner and arena and shares nothing mutable with any other.
+class Parser
+{
+    Lexer &Lex;
+    ASTArena *Arena;
+
+    /// AnonExprName - The name of every top-level expression's function.
+    SymbolID AnonExprName;
+
+    /// CurTok - The current token the parser is looking at.
+    int CurTok = 0;
+
+    /// BinopPrecedence - This holds the precedence for each binary operator
+    /// that is defined.  It starts out with the standard operators, built at
+    /// compile time.
+    PrecedenceTable BinopPrecedence = PrecedenceTable::standard();
+
+    /// OperandStack - The operands ParseExpression has built but not yet
+    /// attached to an operator or a call.  Call arguments wait here until their
+    /// ')' is seen.
+    std::vector<ExprAST *> OperandStack;
+
+    /// PendingOp - An entry on OperatorStack: a binary operator waiting for its
+    /// right-hand side, or the '(' of a parenthesised expression or argument
+    /// list that has not been closed yet.
+    struct PendingOp
+    {
+        enum KindTy { BinOp, Paren, Call } Kind;
+        char Op;            // BinOp: the operator
+        int Prec;           // BinOp: its precedence
+        SymbolID Callee;    // Call: the function being called
+        size_t ArgsBegin;   // Call: where its arguments start on OperandStack
+    };
+    std::vector<PendingOp> OperatorStack;
+
+    /// SymScratch - Collects a prototype's argument names before they are
+    /// copied into the arena.
+    std::vector<SymbolID> SymScratch;
+
+    /// Calls - The callee and argument count of every call in the item being
+    /// parsed.
+    std::vector<std::pair<SymbolID, unsigned>> Calls;
+
+    /// Assigned - Every name the item being parsed assigns to with '='.
+    std::vector<SymbolID> Assigned;
+
+    /// VarScratch - Collects the bindings of the var/in expressions being parsed
+    /// before they are copied into the arena.  Nested ones append after their
+    /// parent's.
+    std::vector<VarBinding> VarScratch;
+
+    /// TokenHash - If set, every token consumed is fed into it.
+    MD5 *TokenHash = nullptr;
+
+    /// Uniquer - Hash-conses the expressions of the current item, if enabled.
+    ExprUniquer Uniquer;
+    bool HashCons = false;
+
+    /// FoldConstants - Whether binary operators on two numbers are evaluated as
+    /// they are parsed.
+    bool FoldConstants = false;
+
+    /// NumTokens/NumNodes - The tokens consumed and expression nodes built since
+    /// they were last added to the -stats counters.
+    size_t NumTokens = 0;
+    size_t NumNodes = 0;
+
+    void hashToken();
+    void flushCounts();
+    void startItem();
+    ExprAST *makeNumber(double Val);
+    ExprAST *makeVariable(SymbolID Name);
+    ExprAST *makeBinary(char Op, ExprAST *LHS, ExprAST *RHS);
+    ExprAST *makeCall(SymbolID Callee, llvm::ArrayRef<ExprAST *> Args);
+    ExprAST *makeFor(SymbolID VarName, ExprAST *Start, ExprAST *End, ExprAST *Step,
+                     ExprAST *Body);
+    ExprAST *makeVar(llvm::ArrayRef<VarBinding> Vars, ExprAST *Body);
+    FunctionAST *makeFunction(PrototypeAST *Proto, ExprAST *Body);
+
+    int GetTokPrecedence();
+    ExprAST *ParseNumberExpr();
+    ExprAST *ParseForExpr();
+    ExprAST *ParseVarExpr();
+    bool ParsePrimary();
+    void ReduceBinOps(size_t OpsBegin, int MinPrec);
+    ExprAST *ParseExpression();
+    PrototypeAST *ParsePrototype(bool Extern = false);
+
+public:
+    Parser(Lexer &Lex, ASTArena &Arena)
+            : Lex(Lex), Arena(&Arena),
+              AnonExprName(Lex.intern("__anon_expr")) {}
+    ~Parser() { flushCounts(); }
+
+    int getCurTok() const { return CurTok; }
+
+    /// setArena - Allocate the items parsed from now on in A.
+    void setArena(ASTArena &A) { Arena = &A; }
+
+    /// getNextToken - Read another token from the lexer and update CurTok with
+    /// its results.
+    int getNextToken()
+    {
+        if (TokenHash)
+            hashToken();
+        ++NumTokens;
+        return CurTok = Lex.gettok();
+    }
+
+    /// setTokenHash - Feed the tokens consumed from now on into H, or stop when
+    /// H is null.  Only the tokens themselves count, not the whitespace and
+    /// comments around them or the way a number is spelled.
+    void setTokenHash(MD5 *H) { TokenHash = H; }
+
+    /// setHashConsing - Build each item's expressions as a DAG in which every
+    /// distinct subexpression appears once.
+    void setHashConsing(bool Enable) { HashCons = Enable; }
+
+    /// setConstantFolding - Replace every binary operator whose operands are
+    /// both numbers by the number it evaluates to.
+    void setConstantFolding(bool Enable) { FoldConstants = Enable; }
+
+    /// getCalls - The calls made by the item parsed last.
+    llvm::ArrayRef<std::pair<SymbolID, unsigned>> getCalls() const { return Calls; }
+
+    FunctionAST *ParseDefinition();
+    PrototypeAST *ParseExtern();
+    FunctionAST *ParseTopLevelExpr();
+};
+
+/// GetTokPrecedence - Get the precedence of the pending binary operator token.
+int Parser::GetTokPrecedence()
+{
+    return BinopPrecedence.get(CurTok);
+}
+
+/// hashToken - Add CurTok, the token about to be consumed, to TokenHash.
+void Parser::hashToken()
+{
+    TokenHash->update(llvm::makeArrayRef((const uint8_t *)&CurTok, sizeof(CurTok)));
+    if (CurTok == tok_identifier) {
+        // Spell identifiers out: SymbolIDs depend on the order names were seen.
+        TokenHash->update(Lex.getSymbols().getName(Lex.getIdentifier()));
+        TokenHash->update(llvm::makeArrayRef((const uint8_t *)"", 1));
+    } else if (CurTok == tok_number) {
+        double Val = Lex.getNumVal();
+        TokenHash->update(llvm::makeArrayRef((const uint8_t *)&Val, sizeof(Val)));
+    }
+}
+
+/// flushCounts - Add the tokens and nodes seen so far to the -stats counters.
+void Parser::flushCounts()
+{
+    if (CountingStats) {
+        AddToCounter(CT_Tokens, NumTokens);
+        AddToCounter(CT_ASTNodes, NumNodes);
+    }
+    NumTokens = NumNodes = 0;
+}
+
+/// startItem - Get ready to parse a new top-level item.
+void Parser::startItem()
+{
+    Calls.clear();
+    Assigned.clear();
+    // The nodes of earlier items may be gone with their arena.
+    Uniquer.clear();
+}
+
+ExprAST *Parser::makeNumber(double Val)
+{
+    ++NumNodes;
+    if (HashCons)
+        return Uniquer.getNumber(*Arena, Val);
+    return Arena->create<NumberExprAST>(Val);
+}
+
+ExprAST *Parser::makeVariable(SymbolID Name)
+{
+    ++NumNodes;
+    if (HashCons)
+        return Uniquer.getVariable(*Arena, Name);
+    return Arena->create<VariableExprAST>(Name);
+}
+
+/// FoldBinOp - Evaluate L Op R in IEEE double arithmetic, storing the result in
+/// Result.  APFloat is what LLVM folds constant operands with, so the result is
+/// bit for bit the one codegen would produce, NaNs included.  Returns false for
+/// an unknown operator, which is left for codegen to report.
+static bool FoldBinOp(char Op, double L, double R, double &Result)
+{
+    APFloat V(L);
+    switch (Op) {
+        case '+':
+            V.add(APFloat(R), APFloat::rmNearestTiesToEven);
+            break;
+        case '-':
+            V.subtract(APFloat(R), APFloat::rmNearestTiesToEven);
+            break;
+        case '*':
+            V.multiply(APFloat(R), APFloat::rmNearestTiesToEven);
+            break;
+        case '<': {
+            // fcmp ult: true if either operand is a NaN.
+            APFloat::cmpResult Cmp = V.compare(APFloat(R));
+            Result = Cmp == APFloat::cmpLessThan || Cmp == APFloat::cmpUnordered;
+            return true;
+        }
+        default:
+            return false;
+    }
+    Result = V.convertToDouble();
+    return true;
+}
+
+ExprAST *Parser::makeBinary(char Op, ExprAST *LHS, ExprAST *RHS)
+{
+    if (FoldConstants) {
+        auto *L = llvm::dyn_cast<NumberExprAST>(LHS);
+        auto *R = llvm::dyn_cast<NumberExprAST>(RHS);
+        double Folded;
+        if (L && R && FoldBinOp(Op, L->getVal(), R->getVal(), Folded))
+            return makeNumber(Folded);
+    }
+
+    if (Op == '=')
+        if (auto *Dest = llvm::dyn_cast<VariableExprAST>(LHS))
+            Assigned.push_back(Dest->getName());
+
+    ++NumNodes;
+    if (HashCons)
+        return Uniquer.getBinary(*Arena, Op, LHS, RHS);
+    return Arena->create<BinaryExprAST>(Op, LHS, RHS);
+}
+
+ExprAST *Parser::makeCall(SymbolID Callee, llvm::ArrayRef<ExprAST *> Args)
+{
+    ++NumNodes;
+    Calls.push_back({Callee, (unsigned)Args.size()});
+    if (HashCons)
+        return Uniquer.getCall(*Arena, Callee, Args);
+    return Arena->create<CallExprAST>(Callee, Arena->copy(Args));
+}
+
+// Loops and variables are never hash-consed: they are not pure, so sharing one
+// would save nothing.
+ExprAST *Parser::makeFor(SymbolID VarName, ExprAST *Start, ExprAST *End, ExprAST *Step,
+                         ExprAST *Body)
+{
+    ++NumNodes;
+    return Arena->create<ForExprAST>(VarName, Start, End, Step, Body);
+}
+
+ExprAST *Parser::makeVar(llvm::ArrayRef<VarBinding> Vars, ExprAST *Body)
+{
+    ++NumNodes;
+    return Arena->create<VarExprAST>(Arena->copy(Vars), Body);
+}
+
+FunctionAST *Parser::makeFunction(PrototypeAST *Proto, ExprAST *Body)
+{
+    return Arena->create<FunctionAST>(Proto, Body, Arena->copy(llvm::makeArrayRef(Assigned)));
+}
+
+/// numberexp ::= number
+ExprAST *Parser::ParseNumberExpr()
+{
+    ExprAST *Result = makeNumber(Lex.getNumVal());
+    getNextToken();
+    return Result;
+}
+
+/// forexpr ::= 'for' identifier '=' expr ',' expr (',' expr)? 'in' expression
+ExprAST *Parser::ParseForExpr()
+{
+    getNextToken();  // eat the for.
+
+    if (CurTok != tok_identifier)
+        return LogError("expected identifier after for");
+
+    SymbolID IdName = Lex.getIdentifier();
+    getNextToken();  // eat identifier.
+
+    if (CurTok != '=')
+        return LogError("expected '=' after for");
+    getNextToken();  // eat '='.
+
+    ExprAST *Start = ParseExpression();
+    if (!Start)
+        return nullptr;
+    if (CurTok != ',')
+        return LogError("expected ',' after for start value");
+    getNextToken();
+
+    ExprAST *End = ParseExpression();
+    if (!End)
+        return nullptr;
+
+    // The step value is optional.
+    ExprAST *Step = nullptr;
+    if (CurTok == ',') {
+        getNextToken();
+        Step = ParseExpression();
+        if (!Step)
+            return nullptr;
+    }
+
+    if (CurTok != tok_in)
+        return LogError("expected 'in' after for");
+    getNextToken();  // eat 'in'.
+
+    ExprAST *Body = ParseExpression();
+    if (!Body)
+        return nullptr;
+
+    return makeFor(IdName, Start, End, Step, Body);
+}
+
+/// varexpr ::= 'var' identifier ('=' expression)?
+///                   (',' identifier ('=' expression)?)* 'in' expression
+ExprAST *Parser::ParseVarExpr()
+{
+    getNextToken();  // eat the var.
+
+    // At least one variable name is required.
+    if (CurTok != tok_identifier)
+        return LogError("expected identifier after var");
+
+    size_t VarsBegin = VarScratch.size();
+    auto Pop = make_scope_exit([&] { VarScratch.resize(VarsBegin); });
+    while (true) {
+        SymbolID Name = Lex.getIdentifier();
+        getNextToken();  // eat identifier.
+
+        // Read the optional initializer.
+        ExprAST *Init = nullptr;
+        if (CurTok == '=') {
+            getNextToken(); // eat the '='.
+            Init = ParseExpression();
+            if (!Init)
+                return nullptr;
+        }
+        VarScratch.push_back({Name, Init});
+
+        // End of var list, exit loop.
+        if (CurTok != ',')
+            break;
+        getNextToken(); // eat the ','.
+
+        if (CurTok != tok_identifier)
+            return LogError("expected identifier list after var");
+    }
+
+    // At this point, we have to have 'in'.
+    if (CurTok != tok_in)
+        return LogError("expected 'in' keyword after 'var'");
+    getNextToken();  // eat 'in'.
+
+    ExprAST *Body = ParseExpression();
+    if (!Body)
+        return nullptr;
+
+    return makeVar(llvm::makeArrayRef(VarScratch).slice(VarsBegin), Body);
+}
+
+/// primary
+///   ::= identifierexpr
+///   ::= numberexpr
+///   ::= parenexpr
+///   ::= forexpr
+///   ::= varexpr
+///
+/// ParsePrimary - Parse up to the next operand and push it on OperandStack.  Any
+/// '(' opening a parenexpr or a call's argument list on the way is pushed on
+/// OperatorStack instead of being parsed recursively; the matching ')' is
+/// handled by ParseExpression.  The parts of a for or var expression are whole
+/// expressions of their own, and are parsed by calling ParseExpression again.
+bool Parser::ParsePrimary()
+{
+    while (true) {
+        switch (CurTok) {
+            default:
+                LogError("unknown token when expecting an expression");
+                return false;
+            case tok_number:
+                OperandStack.push_back(ParseNumberExpr());
+                return true;
+            case tok_malformed_number:
+                LogError("malformed number, which takes digits and at most one '.'");
+                return false;
+            case tok_for:
+            case tok_var: {
+                ExprAST *E = CurTok == tok_for ? ParseForExpr() : ParseVarExpr();
+                if (!E)
+                    return false;
+                OperandStack.push_back(E);
+                return true;
+            }
+            case '(':
+                // parenexpr ::= '(' expression ')'
+                OperatorStack.push_back({PendingOp::Paren, 0, 0, 0, 0});
+                getNextToken();    // eat (
+                break;
+            case tok_identifier: {
+                // identifierexpr
+                //   ::= identifier
+                //   ::= identifier '(' expression* ')'
+                SymbolID IdName = Lex.getIdentifier();
+                getNextToken();    // eat identifier
+
+                if (CurTok != '(') {   // Simple variable ref
+                    OperandStack.push_back(makeVariable(IdName));
+                    return true;
+                }
+
+                // Call
+                getNextToken();    // eat (
+                if (CurTok == ')') {
+                    getNextToken();
+                    OperandStack.push_back(makeCall(IdName, llvm::ArrayRef<ExprAST *>()));
+                    return true;
+                }
+                OperatorStack.push_back(
+                        {PendingOp::Call, 0, 0, IdName, OperandStack.size()});
+                break;
+            }
+        }
+    }
+}
+
+/// ReduceBinOps - Pop every binary operator above OpsBegin whose precedence is
+/// at least MinPrec, building its BinaryExprAST from the top two operands.
+/// Stops at the first '(' so parenthesised operands stay intact.
+void Parser::ReduceBinOps(size_t OpsBegin, int MinPrec)
+{
+    while (OperatorStack.size() > OpsBegin) {
+        const PendingOp &Top = OperatorStack.back();
+        if (Top.Kind != PendingOp::BinOp || Top.Prec < MinPrec)
+            return;
+        ExprAST *RHS = OperandStack.back();
+        OperandStack.pop_back();
+        OperandStack.back() = makeBinary(Top.Op, OperandStack.back(), RHS);
+        OperatorStack.pop_back();
+    }
+}
+
+/// expression
+///   ::= primary binoprhs
+/// binoprhs
+///   ::= (binop primary)*
+///
+/// The whole expression, parentheses and call arguments included, is parsed
+/// by precedence climbing over explicit operand and operator stacks, so time
+/// and space are linear in its length however deeply it nests, and the C++
+/// stack does not grow.
+ExprAST *Parser::ParseExpression()
+{
+    size_t OperandsBegin = OperandStack.size();
+    size_t OpsBegin = OperatorStack.size();
+    auto Fail = [&](const char *Msg) -> ExprAST * {
+        OperandStack.resize(OperandsBegin);
+        OperatorStack.resize(OpsBegin);
+        return Msg ? LogError(Msg) : nullptr;
+    };
+
+    if (!ParsePrimary())
+        return Fail(nullptr);
+
+    while (true) {
+        int TokPrec = GetTokPrecedence();
+        if (TokPrec > 0) {
+            // Everything pending that binds at least as tightly as this binop
+            // is its LHS; it is left-associative.
+            ReduceBinOps(OpsBegin, TokPrec);
+            OperatorStack.push_back({PendingOp::BinOp, (char)CurTok, TokPrec, 0, 0});
+            getNextToken();    // eat binop
+            if (!ParsePrimary())
+                return Fail(nullptr);
+            continue;
+        }
+
+        // Anything else ends the innermost open operand: close it if it is a
+        // ')' or ',' belonging to a paren or call pushed by this expression.
+        ReduceBinOps(OpsBegin, 0);
+        if (OperatorStack.size() == OpsBegin)
+            break;
+
+        PendingOp &Open = OperatorStack.back();
+        if (Open.Kind == PendingOp::Paren) {
+            if (CurTok != ')')
+                return Fail("expected ')'");
+            getNextToken();    // eat )
+            OperatorStack.pop_back();
+            continue;
+        }
+
+        // A call argument has been parsed.
+        if (CurTok == ',') {
+            getNextToken();    // eat ,
+            if (!ParsePrimary())
+                return Fail(nullptr);
+            continue;
+        }
+        if (CurTok != ')')
+            return Fail("Expected ')' or ',' in argument list");
+        getNextToken();    // eat )
+
+        ExprAST *Call = makeCall(Open.Callee,
+                                 llvm::makeArrayRef(OperandStack).slice(Open.ArgsBegin));
+        OperandStack.resize(Open.ArgsBegin);
+        OperandStack.push_back(Call);
+        OperatorStack.pop_back();
+    }
+
+    ExprAST *Result = OperandStack.back();
+    OperandStack.resize(OperandsBegin);
+    return Result;
+}
+
+PrototypeAST *Parser::ParsePrototype(bool Extern)
+{
+    if (CurTok != tok_identifier)
+    return LogErrorP("Expected function name in prototype");
+
+    SymbolID FnName = Lex.getIdentifier();
+    getNextToken();
+
+    if (CurTok != '(')
+        return LogErrorP("Expected '(' in prototype");
+    
+    // Read the list of argument names.
+    SymScratch.clear();
+    while (getNextToken() == tok_identifier)
+        SymScratch.push_back(Lex.getIdentifier());
+    if (CurTok != ')')
+        return LogErrorP("Expected ')' in prototype");
+    
+    // success.
+    getNextToken();     // eat ')'.
+
+    auto ArgNames = Arena->copy(llvm::makeArrayRef(SymScratch));
+    return Arena->create<PrototypeAST>(FnName, ArgNames, Extern);
+}
+
+/// definition ::= 'def' prototype expression
+FunctionAST *Parser::ParseDefinition()
+{
+    PhaseRegion Region(PH_Parse);
+    auto Flush = make_scope_exit([this] { flushCounts(); });
+    startItem();
+    getNextToken();     // eat def.
+    auto Proto = ParsePrototype();
+    if (!Proto) return nullptr;
+
+    if (auto E = ParseExpression())
+        return makeFunction(Proto, E);
+    return nullptr;
+}
+
+/// external ::= 'extern' prototype
+PrototypeAST *Parser::ParseExtern()
+{
+    PhaseRegion Region(PH_Parse);
+    auto Flush = make_scope_exit([this] { flushCounts(); });
+    getNextToken();   // eat extern.
+    return ParsePrototype(/*Extern=*/true);
+}
+
+/// toplevelexpr ::= expression
+FunctionAST *Parser::ParseTopLevelExpr()
+{
+    PhaseRegion Region(PH_Parse);
+    auto Flush = make_scope_exit([this] { flushCounts(); });
+    startItem();
+    if (auto E = ParseExpression()) {
+        // Make an anonymous proto.
+        auto Proto = Arena->create<PrototypeAST>(AnonExprName, llvm::ArrayRef<SymbolID>());
+        return makeFunction(Proto, E);
+    }
+    return nullptr;
+}
+
+/*--------------------------------------------------------------------------------
+ * Host functions
+ *------------------------------------------------------------------------------*/
+// An extern binds to a C function of the host process taking and returning
+// doubles.  The libm functions are known up front, by address, and a host
+// embedding the JIT can register its own; anything else is found with dlsym
+// the first time an extern needs it.
+
+typedef double (*UnaryFn)(double);
+typedef double (*BinaryFn)(double, double);
+typedef double (*TernaryFn)(double, double, double);
+
+/// LibmFunction - A libm function externs can bind to, and the LLVM intrinsic
+/// that computes the same thing, if there is one.
+struct LibmFunction
+{
+    const char *Name;
+    unsigned NumArgs;
+    Intrinsic::ID ID;
+    void *Addr;
+};
+
+static const LibmFunction LibmFunctions[] = {
+    {"sin", 1, Intrinsic::sin, (void *)(UnaryFn)::sin},
+    {"cos", 1, Intrinsic::cos, (void *)(UnaryFn)::cos},
+    {"exp", 1, Intrinsic::exp, (void *)(UnaryFn)::exp},
+    {"exp2", 1, Intrinsic::exp2, (void *)(UnaryFn)::exp2},
+    {"log", 1, Intrinsic::log, (void *)(UnaryFn)::log},
+    {"log2", 1, Intrinsic::log2, (void *)(UnaryFn)::log2},
+    {"log10", 1, Intrinsic::log10, (void *)(UnaryFn)::log10},
+    {"sqrt", 1, Intrinsic::sqrt, (void *)(UnaryFn)::sqrt},
+    {"fabs", 1, Intrinsic::fabs, (void *)(UnaryFn)::fabs},
+    {"floor", 1, Intrinsic::floor, (void *)(UnaryFn)::floor},
+    {"ceil", 1, Intrinsic::ceil, (void *)(UnaryFn)::ceil},
+    {"trunc", 1, Intrinsic::trunc, (void *)(UnaryFn)::trunc},
+    {"round", 1, Intrinsic::round, (void *)(UnaryFn)::round},
+    {"rint", 1, Intrinsic::rint, (void *)(UnaryFn)::rint},
+    {"nearbyint", 1, Intrinsic::nearbyint, (void *)(UnaryFn)::nearbyint},
+    {"pow", 2, Intrinsic::pow, (void *)(BinaryFn)::pow},
+    {"fmin", 2, Intrinsic::minnum, (void *)(BinaryFn)::fmin},
+    {"fmax", 2, Intrinsic::maxnum, (void *)(BinaryFn)::fmax},
+    {"copysign", 2, Intrinsic::copysign, (void *)(BinaryFn)::copysign},
+    {"fma", 3, Intrinsic::fma, (void *)(TernaryFn)::fma},
+    {"tan", 1, Intrinsic::not_intrinsic, (void *)(UnaryFn)::tan},
+    {"asin", 1, Intrinsic::not_intrinsic, (void *)(UnaryFn)::asin},
+    {"acos", 1, Intrinsic::not_intrinsic, (void *)(UnaryFn)::acos},
+    {"atan", 1, Intrinsic::not_intrinsic, (void *)(UnaryFn)::atan},
+    {"sinh", 1, Intrinsic::not_intrinsic, (void *)(UnaryFn)::sinh},
+    {"cosh", 1, Intrinsic::not_intrinsic, (void *)(UnaryFn)::cosh},
+    {"tanh", 1, Intrinsic::not_intrinsic, (void *)(UnaryFn)::tanh},
+    {"cbrt", 1, Intrinsic::not_intrinsic, (void *)(UnaryFn)::cbrt},
+    {"atan2", 2, Intrinsic::not_intrinsic, (void *)(BinaryFn)::atan2},
+    {"hypot", 2, Intrinsic::not_intrinsic, (void *)(BinaryFn)::hypot},
+    {"fmod", 2, Intrinsic::not_intrinsic, (void *)(BinaryFn)::fmod},
+};
+
+/// HostSymbols - The address of every host function looked up or registered so
+/// far, by name; null for a name dlsym did not find.  It starts out holding
+/// LibmFunctions.
+static StringMap<void *> HostSymbols = [] {
+    StringMap<void *> Table;
+    for (const LibmFunction &F : LibmFunctions)
+        Table[F.Name] = F.Addr;
+    return Table;
+}();
+static std::mutex HostSymbolsLock;
+
+/// HostRegistered - The names RegisterHostFunction has bound.  A host function
+/// may share its name with a C library one, so LLVM must not take a call to it
+/// for a call to the library function it knows.
+static StringSet<> HostRegistered;
+
+/// LookupHostFunction - The address of the host function Name, or null if the
+/// process has none.  A name that was not registered costs one dlsym, the first
+/// time it is asked for.
+static void *LookupHostFunction(StringRef Name)
+{
+    std::lock_guard<std::mutex> Lock(HostSymbolsLock);
+    auto Inserted = HostSymbols.try_emplace(Name, nullptr);
+    if (Inserted.second)
+        Inserted.first->second = dlsym(RTLD_DEFAULT, Name.str().c_str());
+    return Inserted.first->second;
+}
+
+/// IsHostRegistered - Whether the host has registered a function of its own
+/// under Name.
+static bool IsHostRegistered(StringRef Name)
+{
+    std::lock_guard<std::mutex> Lock(HostSymbolsLock);
+    return HostRegistered.count(Name);
+}
+
+/// LibmIntrinsic - The intrinsic computing the libm function Name of NumArgs
+/// arguments, or not_intrinsic if there is none or the host has registered a
+/// function of its own under that name.
+static Intrinsic::ID LibmIntrinsic(StringRef Name, size_t NumArgs)
+{
+    for (const LibmFunction &F : LibmFunctions)
+        if (F.NumArgs == NumArgs && Name == F.Name)
+            return IsHostRegistered(Name) ? Intrinsic::not_intrinsic : F.ID;
+    return Intrinsic::not_intrinsic;
+}
+
+/// RegisterHostFunction - For hosts embedding the JIT: bind externs named Name
+/// to Addr, a function taking the extern's arguments as doubles and returning
+/// a double, instead of whatever dlsym would find.  Code that has already been
+/// linked against Name keeps the address it was given.
+void RegisterHostFunction(StringRef Name, void *Addr)
+{
+    std::lock_guard<std::mutex> Lock(HostSymbolsLock);
+    HostSymbols[Name] = Addr;
+    HostRegistered.insert(Name);
+}
+
+/*--------------------------------------------------------------------------------
+ * Code Generation
+ *------------------------------------------------------------------------------*/
+/// Symbols - The interner of the driver's parse sessions.  Code generation reads
+/// the names of the SymbolIDs in the AST back from it.
+static SymbolInterner Symbols;
+
+// The module being generated and everything used to generate and optimise it
+// are per thread, so that definitions can be compiled in parallel, each in a
+// context of its own.
+static thread_local std::unique_ptr<LLVMContext> TheContext;
+static thread_local std::unique_ptr<Module> TheModule;
+static thread_local std::unique_ptr<IRBuilder<>> Builder;
+
+/// NamedValues - The value of every variable in scope: the argument itself, or
+/// for a variable that can be assigned, the entry-block alloca holding it.
+static thread_local DenseMap<SymbolID, Value *> NamedValues;
+
+/// SharedValues - The value computed for each shared subexpression of the
+/// function being generated, so a hash-consed DAG is lowered once per node
+/// rather than once per occurrence.  Only call-free subtrees are shared, so
+/// every call still happens as often as the source says.  A store or a new
+/// binding may change what a variable reads as, and a value need not dominate
+/// a new block, so the map is cleared at each of them.
+static thread_local DenseMap<const ExprAST *, Value *> SharedValues;
+static std::unique_ptr<LLJIT> TheJIT;
+static ExitOnError ExitOnErr;
+
+/// TheFPM/TheFAM - The per-function pipeline every definition is run through as
+/// it is generated, and the analyses it uses.  TheFPM is null at -O0 and in
+/// batch mode, where the whole module is optimised at once instead.
+static thread_local std::unique_ptr<FunctionPassManager> TheFPM;
+static thread_local std::unique_ptr<FunctionAnalysisManager> TheFAM;
+
+/// FunctionProtos - The most recent prototype of every function, so that each
+/// new module can declare the functions already handed to the JIT.  Item
+/// arenas are reset after every item, so these copies live in ProtoArena.
+static ASTArena ProtoArena;
+static DenseMap<SymbolID, PrototypeAST *> FunctionProtos;
+
+Value *LogErrorV(const char *Str)
+{
+    LogError(Str);
+    return nullptr;
+}
+
+/// RememberPrototype - Record P in FunctionProtos, copying it out of the item arena.
+/// If an identical prototype is already recorded, the map is only read, which
+/// is what lets parallel compile jobs share it.
+static PrototypeAST &RememberPrototype(PrototypeAST &P)
+{
+    PrototypeAST *Known = FunctionProtos.lookup(P.getName());
+    if (Known && Known->getArgs() == P.getArgs() && Known->isExtern() == P.isExtern())
+        return *Known;
+
+    PrototypeAST *Copy = ProtoArena.create<PrototypeAST>(
+            P.getName(), ProtoArena.copy(P.getArgs()), P.isExtern());
+    FunctionProtos[P.getName()] = Copy;
+    return *Copy;
+}
+
+/// getFunction - Find Name in the current module, declaring it there from its
+/// remembered prototype if it was defined in an earlier one.
+static Function *getFunction(SymbolID Name)
+{
+    // First, see if the function has already been added to the current module.
+    if (auto *F = TheModule->getFunction(Symbols.getName(Name)))
+        return F;
+
+    // If not, check whether we can codegen the declaration from some existing
+    // prototype.
+    auto FI = FunctionProtos.find(Name);
+    if (FI != FunctionProtos.end())
+        return FI->second->codegen();
+
+    // If no existing prototype exists, return null.
+    return nullptr;
+}
+
+Value *NumberExprAST::codegen()
+{
+    return ConstantFP::get(*TheContext, APFloat(Val));
+}
+
+/// CreateEntryBlockAlloca - Create an alloca instruction in the entry block of
+/// the function.  This is used for mutable variables etc.; keeping every alloca
+/// there is what lets mem2reg promote them to registers.
+static AllocaInst *CreateEntryBlockAlloca(Function *TheFunction, StringRef VarName)
+{
+    IRBuilder<> TmpB(&TheFunction->getEntryBlock(), TheFunction->getEntryBlock().begin());
+    return TmpB.CreateAlloca(Type::getDoubleTy(*TheContext), nullptr, VarName);
+}
+
+/// RestoreBinding - Put back the value Name had before a for or var expression
+/// bound it, which is null if it had none.
+static void RestoreBinding(SymbolID Name, Value *Old)
+{
+    SharedValues.clear();
+    if (Old)
+        NamedValues[Name] = Old;
+    else
+        NamedValues.erase(Name);
+}
+
+Value *VariableExprAST::codegen()
+{
+    // Look this variable up in the function.
+    Value *V = NamedValues.lookup(Name);
+    if (!V)
+        return LogErrorV("Unknown variable name");
+
+    // Load the value of a mutable variable.
+    if (auto *A = dyn_cast<AllocaInst>(V))
+        return Builder->CreateLoad(A->getAllocatedType(), A, Symbols.getName(Name));
+    return V;
+}
+
+Value *BinaryExprAST::codegen()
+{
+    // Special case '=' because we don't want to emit the LHS as an expression.
+    if (Op == '=') {
+        // Assignment requires the LHS to be an identifier.
+        auto *LHSE = dyn_cast<VariableExprAST>(LHS);
+        if (!LHSE)
+            return LogErrorV("destination of '=' must be a variable");
+
+        // Codegen the RHS.
+        Value *Val = RHS->codegen();
+        if (!Val)
+            return nullptr;
+
+        // Look up the name.  Every variable assigned to has an alloca.
+        auto *Variable = dyn_cast_or_null<AllocaInst>(NamedValues.lookup(LHSE->getName()));
+        if (!Variable)
+            return LogErrorV("Unknown variable name");
+
+        Builder->CreateStore(Val, Variable);
+        SharedValues.clear();
+        return Val;
+    }
+
+    if (isShared()) {
+        if (Value *V = SharedValues.lookup(this))
+            return V;
+    }
+
+    Value *L = LHS->codegen();
+    Value *R = RHS->codegen();
+    if (!L || !R)
+        return nullptr;
+
+    Value *Result;
+    switch (Op) {
+        case '+':
+            Result = Builder->CreateFAdd(L, R, "addtmp");
+            break;
+        case '-':
+            Result = Builder->CreateFSub(L, R, "subtmp");
+            break;
+        case '*':
+            Result = Builder->CreateFMul(L, R, "multmp");
+            break;
+        case '<':
+            L = Builder->CreateFCmpULT(L, R, "cmptmp");
+            // Convert bool 0/1 to double 0.0 or 1.0
+            Result = Builder->CreateUIToFP(L, Type::getDoubleTy(*TheContext), "booltmp");
+            break;
+        default:
+            return LogErrorV("invalid binary operator");
+    }
+
+    if (isShared())
+        SharedValues[this] = Result;
+    return Result;
+}
+
+static cl::opt<bool> LibmIntrinsics("libm-intrinsics", cl::init(true),
+        cl::desc("Lower calls to libm externs such as sin and sqrt to LLVM intrinsics"));
+
+/// HostIntrinsic - The intrinsic a call to Callee with NumArgs arguments is
+/// lowered to: an extern of a libm function LLVM knows becomes the intrinsic,
+/// which is free of side effects, so the optimiser can fold, hoist and
+/// vectorise it like any other instruction rather than treat it as an opaque
+/// call.  Returns not_intrinsic for anything else.
+static Intrinsic::ID HostIntrinsic(SymbolID Callee, size_t NumArgs)
+{
+    if (!LibmIntrinsics)
+        return Intrinsic::not_intrinsic;
+    PrototypeAST *Proto = FunctionProtos.lookup(Callee);
+    if (!Proto || !Proto->isExtern() || Proto->getArgs().size() != NumArgs)
+        return Intrinsic::not_intrinsic;
+    return LibmIntrinsic(Symbols.getName(Callee), NumArgs);
+}
+
+/// ResolveCallee - The function a call to Callee with NumArgs arguments makes,
+/// or null after reporting why there is none.
+static Function *ResolveCallee(SymbolID Callee, size_t NumArgs)
+{
+    if (Intrinsic::ID ID = HostIntrinsic(Callee, NumArgs))
+        return Intrinsic::getDeclaration(TheModule.get(), ID, {Type::getDoubleTy(*TheContext)});
+
+    // Look up the name in the global module table.
+    Function *CalleeF = getFunction(Callee);
+    if (!CalleeF)
+        return (Function *)LogErrorV("Unknown function referenced");
+
+    // If argument mismatch error.
+    if (CalleeF->arg_size() != NumArgs)
+        return (Function *)LogErrorV("Incorrect # arguments passed");
+    return CalleeF;
+}
+
+Value *CallExprAST::codegen()
+{
+    Function *CalleeF = ResolveCallee(Callee, Args.size());
+    if (!CalleeF)
+        return nullptr;
+
+    std::vector<Value *> ArgsV;
+    ArgsV.reserve(Args.size());
+    for (ExprAST *Arg : Args) {
+        ArgsV.push_back(Arg->codegen());
+        if (!ArgsV.back())
+            return nullptr;
+    }
+
+    return Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+}
+
+// Output for-loop as:
+//   var = alloca double
+//   ...
+//   start = startexpr
+//   store start -> var
+//   goto loop
+// loop:
+//   ...
+//   bodyexpr
+//   ...
+// loopend:
+//   step = stepexpr
+//   endcond = endexpr
+//
+//   curvar = load var
+//   nextvar = curvar + step
+//   store nextvar -> var
+//   br endcond, loop, endloop
+// outloop:
+Value *ForExprAST::codegen()
+{
+    Function *TheFunction = Builder->GetInsertBlock()->getParent();
+
+    // Create an alloca for the variable in the entry block.
+    AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, Symbols.getName(VarName));
+
+    // Emit the start code first, without 'variable' in scope.
+    Value *StartVal = Start->codegen();
+    if (!StartVal)
+        return nullptr;
+
+    // Store the value into the alloca.
+    Builder->CreateStore(StartVal, Alloca);
+
+    // Make the new basic block for the loop header, inserting after current
+    // block.
+    BasicBlock *LoopBB = BasicBlock::Create(*TheContext, "loop", TheFunction);
+
+    // Insert an explicit fall through from the current block to the LoopBB.
+    Builder->CreateBr(LoopBB);
+
+    // Start insertion in LoopBB.
+    Builder->SetInsertPoint(LoopBB);
+    SharedValues.clear();
+
+    // Within the loop, the variable is defined equal to the alloca.  If it
+    // shadows an existing variable, we have to restore it, so save it now.
+    Value *OldVal = NamedValues.lookup(VarName);
+    NamedValues[VarName] = Alloca;
+
+    // Emit the body of the loop.  This, like any other expr, can change the
+    // current BB.  Note that we ignore the value computed by the body, but don't
+    // allow an error.
+    if (!Body->codegen())
+        return nullptr;
+
+    // Emit the step value.
+    Value *StepVal = nullptr;
+    if (Step) {
+        StepVal = Step->codegen();
+        if (!StepVal)
+            return nullptr;
+    } else {
+        // If not specified, use 1.0.
+        StepVal = ConstantFP::get(*TheContext, APFloat(1.0));
+    }
+
+    // Compute the end condition.
+    Value *EndCond = End->codegen();
+    if (!EndCond)
+        return nullptr;
+
+    // Reload, increment, and restore the alloca.  This handles the case where
+    // the body of the loop mutates the variable.
+    Value *CurVar = Builder->CreateLoad(Alloca->getAllocatedType(), Alloca,
+                                        Symbols.getName(VarName));
+    Value *NextVar = Builder->CreateFAdd(CurVar, StepVal, "nextvar");
+    Builder->CreateStore(NextVar, Alloca);
+
+    // Convert condition to a bool by comparing non-equal to 0.0.
+    EndCond = Builder->CreateFCmpONE(
+            EndCond, ConstantFP::get(*TheContext, APFloat(0.0)), "loopcond");
+
+    // Create the "after loop" block and insert it.
+    BasicBlock *AfterBB = BasicBlock::Create(*TheContext, "afterloop", TheFunction);
+
+    // Insert the conditional branch into the end of LoopEndBB.
+    Builder->CreateCondBr(EndCond, LoopBB, AfterBB);
+
+    // Any new code will be inserted in AfterBB.
+    Builder->SetInsertPoint(AfterBB);
+    SharedValues.clear();
+
+    // Restore the unshadowed variable.
+    RestoreBinding(VarName, OldVal);
+
+    // for expr always returns 0.0.
+    return Constant::getNullValue(Type::getDoubleTy(*TheContext));
+}
+
+Value *VarExprAST::codegen()
+{
+    SmallVector<Value *, 4> OldBindings;
+    Function *TheFunction = Builder->GetInsertBlock()->getParent();
+
+    // Register all variables and emit their initializer.
+    for (const VarBinding &Var : Vars) {
+        // Emit the initializer before adding the variable to scope, this prevents
+        // the initializer from referencing the variable itself, and permits stuff
+        // like this:
+        //  var a = 1 in
+        //    var a = a in ...   # refers to outer 'a'.
+        Value *InitVal;
+        if (Var.Init) {
+            InitVal = Var.Init->codegen();
+            if (!InitVal)
+                return nullptr;
+        } else { // If not specified, use 0.0.
+            InitVal = ConstantFP::get(*TheContext, APFloat(0.0));
+        }
+
+        AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, Symbols.getName(Var.Name));
+        Builder->CreateStore(InitVal, Alloca);
+
+        // Remember the old variable binding so that we can restore the binding
+        // when we unrecurse.
+        OldBindings.push_back(NamedValues.lookup(Var.Name));
+
+        // Remember this binding.
+        NamedValues[Var.Name] = Alloca;
+        SharedValues.clear();
+    }
+
+    // Codegen the body, now that all vars are in scope.
+    Value *BodyVal = Body->codegen();
+    if (!BodyVal)
+        return nullptr;
+
+    // Pop all our variables from scope, innermost first in case a name repeats.
+    for (size_t I = Vars.size(); I-- != 0;)
+        RestoreBinding(Vars[I].Name, OldBindings[I]);
+
+    // Return the body computation.
+    return BodyVal;
+}
+
+static cl::opt<bool> FlatAST("flat-ast",
+        cl::desc("Lay each function body out as a flat array of nodes and generate "
+                 "code and bytecode from that, instead of walking the tree"));
+
+/// FlatBody/FlatValues/FlatCallees - The function body being generated with
+/// -flat-ast, the value of each of its nodes, and the callee of each of its calls.
+static thread_local FlatExpr FlatBody;
+static thread_local std::vector<Value *> FlatValues;
+static thread_local std::vector<Function *> FlatCallees;
+
+/// CodegenFlat - Generate code for E in one pass over its nodes, returning the
+/// value of the root.  The instructions, and any error, are those the tree
+/// would give.
+static Value *CodegenFlat(const FlatExpr &E)
+{
+    FlatValues.resize(E.size());
+    FlatCallees.resize(E.Calls.size());
+    size_t NextCall = 0;
+    for (uint32_t I = 0; I != E.size(); ++I) {
+        // Resolving a callee may declare it, so do it where the tree would.
+        for (; NextCall != E.Calls.size() && E.Calls[NextCall].Start == I; ++NextCall) {
+            const FlatExpr::FlatCall &C = E.Calls[NextCall];
+            if (!(FlatCallees[NextCall] = ResolveCallee(C.Callee, C.NumArgs)))
+                return nullptr;
+        }
+
+        Value *&Result = FlatValues[I];
+        switch (E.getKind(I)) {
+            case ExprAST::EK_Number:
+                Result = ConstantFP::get(*TheContext, APFloat(E.Numbers[E.A[I]]));
+                break;
+            case ExprAST::EK_Variable:
+                if (!(Result = NamedValues.lookup(E.A[I])))
+                    return LogErrorV("Unknown variable name");
+                break;
+            case ExprAST::EK_Binary: {
+                Value *L = FlatValues[E.A[I]], *R = FlatValues[E.B[I]];
+                switch (E.Ops[I]) {
+                    case '+':
+                        Result = Builder->CreateFAdd(L, R, "addtmp");
+                        break;
+                    case '-':
+                        Result = Builder->CreateFSub(L, R, "subtmp");
+                        break;
+                    case '*':
+                        Result = Builder->CreateFMul(L, R, "multmp");
+                        break;
+                    case '<':
+                        L = Builder->CreateFCmpULT(L, R, "cmptmp");
+                        // Convert bool 0/1 to double 0.0 or 1.0
+                        Result = Builder->CreateUIToFP(L, Type::getDoubleTy(*TheContext),
+                                                       "booltmp");
+                        break;
+                    default:
+                        return LogErrorV("invalid binary operator");
+                }
+                break;
+            }
+            case ExprAST::EK_Call: {
+                const FlatExpr::FlatCall &C = E.Calls[E.A[I]];
+                SmallVector<Value *, 8> ArgsV;
+                for (uint32_t Arg : E.getArgs(C))
+                    ArgsV.push_back(FlatValues[Arg]);
+                Result = Builder->CreateCall(FlatCallees[E.A[I]], ArgsV, "calltmp");
+                break;
+            }
+            case ExprAST::EK_For:
+            case ExprAST::EK_Var:
+                llvm_unreachable("not in a flat layout");
+        }
+    }
+    return FlatValues.back();
+}
+
+Function *PrototypeAST::codegen()
+{
+    // Make the function type:  double(double,double) etc.
+    std::vector<Type *> Doubles(Args.size(), Type::getDoubleTy(*TheContext));
+    FunctionType *FT =
+            FunctionType::get(Type::getDoubleTy(*TheContext), Doubles, false);
+
+    Function *F = Function::Create(FT, Function::ExternalLinkage,
+                                   Symbols.getName(Name), TheModule.get());
+
+    // Set names for all arguments.
+    unsigned Idx = 0;
+    for (auto &Arg : F->args())
+        Arg.setName(Symbols.getName(Args[Idx++]));
+
+    // Otherwise the optimiser would turn a call to a host "floor" into one to
+    // libm's, or into llvm.floor.
+    if (Extern && IsHostRegistered(F->getName()))
+        F->addFnAttr(Attribute::NoBuiltin);
+    return F;
+}
+
+Function *FunctionAST::codegen()
+{
+    PhaseRegion Region(PH_Codegen);
+
+    // Transfer ownership of the prototype to the FunctionProtos map, but keep a
+    // reference to it for use below.
+    PrototypeAST &P = RememberPrototype(*Proto);
+    Function *TheFunction = getFunction(P.getName());
+    if (!TheFunction)
+        return nullptr;
+
+    if (!TheFunction->empty())
+        return (Function *)LogErrorV("Function cannot be redefined.");
+
+    // Create a new basic block to start insertion into.
+    BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", TheFunction);
+    Builder->SetInsertPoint(BB);
+
+    // Record the function arguments in the NamedValues map.  The ones the body
+    // assigns to are copied into allocas; the rest stay plain SSA values.
+    NamedValues.clear();
+    SharedValues.clear();
+    unsigned Idx = 0;
+    for (auto &Arg : TheFunction->args()) {
+        SymbolID Name = P.getArgs()[Idx++];
+        if (isAssigned(Name)) {
+            AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, Arg.getName());
+            Builder->CreateStore(&Arg, Alloca);
+            NamedValues[Name] = Alloca;
+        } else {
+            NamedValues[Name] = &Arg;
+        }
+    }
+
+    Value *RetVal;
+    if (FlatAST && FlatBody.assign(Body)) {
+        RetVal = CodegenFlat(FlatBody);
+    } else {
+        RetVal = Body->codegen();
+    }
+    if (RetVal) {
+        // Finish off the function.
+        Builder->CreateRet(RetVal);
+
+        // Validate the generated code, checking for consistency.
+        verifyFunction(*TheFunction);
+        if (CountingStats)
+            AddToCounter(CT_IRInstructions, TheFunction->getInstructionCount());
+
+        // Optimize the function.
+        if (TheFPM) {
+            PhaseRegion Region(PH_Optimize);
+            TheFPM->run(*TheFunction, *TheFAM);
+        }
+
+        return TheFunction;
+    }
+
+    // Error reading body, remove function.
+    TheFunction->eraseFromParent();
+    return nullptr;
+}
+
+/// EmitBatchWrapper - Add F.batch to F's module:
+///
+///   void F.batch(const double *const *Cols, double *Out, uint64_t N)
+///
+/// sets Out[i] = F(Cols[0][i], ..., Cols[K-1][i]) for every i < N.  The call is
+/// always inlined and Out may not alias the columns, so once the module has been
+/// through the whole-module pipeline at -O2 or above the loop is vectorised for
+/// the host, instead of costing one call per row.
+static Function *EmitBatchWrapper(Function *F)
+{
+    LLVMContext &Ctx = *TheContext;
+    Type *DoubleTy = Type::getDoubleTy(Ctx);
+    Type *DoublePtrTy = DoubleTy->getPointerTo();
+    Type *Int64Ty = Type::getInt64Ty(Ctx);
+    FunctionType *FT = FunctionType::get(Type::getVoidTy(Ctx),
+                                         {DoublePtrTy->getPointerTo(), DoublePtrTy, Int64Ty},
+                                         false);
+    Function *W = Function::Create(FT, Function::ExternalLinkage, F->getName() + ".batch",
+                                   TheModule.get());
+    Argument *Cols = W->getArg(0), *Out = W->getArg(1), *N = W->getArg(2);
+    Cols->setName("cols");
+    Out->setName("out");
+    N->setName("n");
+    for (unsigned Idx : {0, 1}) {
+        W->addParamAttr(Idx, Attribute::NoAlias);
+        W->addParamAttr(Idx, Attribute::NoCapture);
+    }
+    W->addParamAttr(0, Attribute::ReadOnly);
+
+    BasicBlock *Entry = BasicBlock::Create(Ctx, "entry", W);
+    BasicBlock *Loop = BasicBlock::Create(Ctx, "loop", W);
+    BasicBlock *Exit = BasicBlock::Create(Ctx, "exit", W);
+
+    // Load the column pointers once, outside the loop.
+    Builder->SetInsertPoint(Entry);
+    std::vector<Value *> ColPtrs;
+    for (unsigned K = 0, E = F->arg_size(); K != E; ++K) {
+        Value *Slot = Builder->CreateConstInBoundsGEP1_64(DoublePtrTy, Cols, K);
+        ColPtrs.push_back(Builder->CreateLoad(DoublePtrTy, Slot, "col"));
+    }
+    Builder->CreateCondBr(Builder->CreateICmpEQ(N, ConstantInt::get(Int64Ty, 0)), Exit, Loop);
+
+    Builder->SetInsertPoint(Loop);
+    PHINode *I = Builder->CreatePHI(Int64Ty, 2, "i");
+    I->addIncoming(ConstantInt::get(Int64Ty, 0), Entry);
+    std::vector<Value *> ArgsV;
+    for (Value *Col : ColPtrs)
+        ArgsV.push_back(Builder->CreateLoad(
+                DoubleTy, Builder->CreateInBoundsGEP(DoubleTy, Col, I), "arg"));
+    CallInst *Call = Builder->CreateCall(F, ArgsV, "calltmp");
+    Call->addFnAttr(Attribute::AlwaysInline);
+    Builder->CreateStore(Call, Builder->CreateInBoundsGEP(DoubleTy, Out, I));
+    Value *Next = Builder->CreateNUWAdd(I, ConstantInt::get(Int64Ty, 1), "next");
+    I->addIncoming(Next, Loop);
+    Builder->CreateCondBr(Builder->CreateICmpEQ(Next, N), Exit, Loop);
+
+    Builder->SetInsertPoint(Exit);
+    Builder->CreateRetVoid();
+
+    verifyFunction(*W);
+    return W;
+}
+
+/*--------------------------------------------------------------------------------
+ * Optimization
+ *------------------------------------------------------------------------------*/
+static cl::opt<char> OptLevel("O",
+        cl::desc("Optimization level. [-O0, -O1, -O2, or -O3] (default = '-O2')"),
+        cl::Prefix, cl::ZeroOrMore, cl::init('2'));
+
+static cl::opt<bool> BatchMode("batch",
+        cl::desc("Compile each input as one module, optimised as a whole, before "
+                 "running any of its top-level expressions"));
+
+static cl::opt<unsigned> NumThreads("j",
+        cl::desc("Compile the definitions of each input in parallel on this many "
+                 "threads, each in a module of its own (implies -batch)"),
+        cl::Prefix, cl::init(1));
+
+static cl::opt<bool> HashCons("hash-cons",
+        cl::desc("Share identical subexpressions of each item in the AST and lower "
+                 "each call-free one only once"));
+
+static cl::opt<bool> FoldConstants("fold-constants",
+        cl::desc("Evaluate operators on two numbers while parsing instead of "
+                 "leaving them for codegen"));
+
+static cl::opt<bool> BatchWrappers("batch-wrappers",
+        cl::desc("Compile a vectorised wrapper NAME.batch(cols, out, n) next to "
+                 "every definition NAME, for EvaluateBatch"));
+
+static cl::opt<bool> LazyCompile("lazy",
+        cl::desc("Keep each definition as unoptimised IR and only optimise and "
+                 "compile it when it is first called"));
+
+/// TheJTMB - Describes the host target; each thread makes its own TargetMachine
+/// from it, as a TargetMachine is not safe to share between threads.
+static std::unique_ptr<JITTargetMachineBuilder> TheJTMB;
+static thread_local std::unique_ptr<TargetMachine> TheTM;
+static thread_local std::unique_ptr<PassInstrumentationCallbacks> ThePIC;
+static thread_local std::unique_ptr<PassBuilder> ThePB;
+static thread_local std::unique_ptr<LoopAnalysisManager> TheLAM;
+static thread_local std::unique_ptr<CGSCCAnalysisManager> TheCGAM;
+static thread_local std::unique_ptr<ModuleAnalysisManager> TheMAM;
+
+static OptimizationLevel getOptimizationLevel()
+{
+    switch (OptLevel) {
+        case '0': return OptimizationLevel::O0;
+        case '1': return OptimizationLevel::O1;
+        case '3': return OptimizationLevel::O3;
+        default:  return OptimizationLevel::O2;
+    }
+}
+
+static CodeGenOpt::Level getCodeGenOptLevel()
+{
+    switch (OptLevel) {
+        case '0': return CodeGenOpt::None;
+        case '1': return CodeGenOpt::Less;
+        case '3': return CodeGenOpt::Aggressive;
+        default:  return CodeGenOpt::Default;
+    }
+}
+
+/// BuildFunctionPipeline - The pipeline each function gets on its own outside
+/// batch mode: nothing at -O0, for the lowest latency; mem2reg, instcombine and
+/// simplifycfg at -O1; plus reassociate and GVN at -O2; and LLVM's full function
+/// simplification pipeline at -O3.
+static std::unique_ptr<FunctionPassManager> BuildFunctionPipeline()
+{
+    if (OptLevel == '0')
+        return nullptr;
+
+    if (OptLevel == '3')
+        return std::make_unique<FunctionPassManager>(
+                ThePB->buildFunctionSimplificationPipeline(OptimizationLevel::O3,
+                                                           ThinOrFullLTOPhase::None));
+
+    auto FPM = std::make_unique<FunctionPassManager>();
+    // Promote allocas to registers.
+    FPM->addPass(PromotePass());
+    // Do simple "peephole" optimizations and bit-twiddling optzns.
+    FPM->addPass(InstCombinePass());
+    if (OptLevel == '2') {
+        // Reassociate expressions.
+        FPM->addPass(ReassociatePass());
+        // Eliminate Common SubExpressions.
+        FPM->addPass(GVNPass());
+    }
+    // Simplify the control flow graph (deleting unreachable blocks, etc).
+    FPM->addPass(SimplifyCFGPass());
+    return FPM;
+}
+
+/// PassFrame - A pass or analysis running on this thread, timed for
+/// -time-passes.  ChildNanos is the time spent in those it ran itself.
+struct PassFrame
+{
+    StringRef Name;
+    std::chrono::steady_clock::time_point Start;
+    uint64_t ChildNanos;
+};
+static thread_local SmallVector<PassFrame, 8> PassStack;
+
+/// IsPassManager - Whether PassID only runs other passes, so has no time of its
+/// own worth reporting.
+static bool IsPassManager(StringRef PassID)
+{
+    static const std::vector<StringRef> Managers = {
+            "PassManager", "PassAdaptor", "AnalysisManagerProxy",
+            "ModuleInlinerWrapperPass", "DevirtSCCRepeatedPass"};
+    return isSpecialPass(PassID, Managers);
+}
+
+static void StartPassTimer(StringRef PassID)
+{
+    if (!IsPassManager(PassID))
+        PassStack.push_back({PassID, std::chrono::steady_clock::now(), 0});
+}
+
+static void StopPassTimer(StringRef PassID)
+{
+    if (IsPassManager(PassID))
+        return;
+    PassFrame F = PassStack.pop_back_val();
+    uint64_t Nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - F.Start).count();
+    if (!PassStack.empty())
+        PassStack.back().ChildNanos += Nanos;
+
+    std::lock_guard<std::mutex> Lock(PassTimingLock);
+    PassTiming &T = PassTimings[F.Name];
+    T.Nanos += Nanos - F.ChildNanos;
+    ++T.Runs;
+}
+
+/// RegisterPassTimers - Time every pass and analysis run through PIC.
+static void RegisterPassTimers(PassInstrumentationCallbacks &PIC)
+{
+    PIC.registerBeforeNonSkippedPassCallback(
+            [](StringRef PassID, Any) { StartPassTimer(PassID); });
+    PIC.registerAfterPassCallback(
+            [](StringRef PassID, Any, const PreservedAnalyses &) { StopPassTimer(PassID); });
+    PIC.registerAfterPassInvalidatedCallback(
+            [](StringRef PassID, const PreservedAnalyses &) { StopPassTimer(PassID); });
+    PIC.registerBeforeAnalysisCallback(
+            [](StringRef PassID, Any) { StartPassTimer(PassID); });
+    PIC.registerAfterAnalysisCallback(
+            [](StringRef PassID, Any) { StopPassTimer(PassID); });
+}
+
+/// InitializeOptimizer - Create the analysis managers for the current module
+/// and, outside batch and lazy mode, the function pipeline, which each function
+/// gets as soon as it has been generated.
+static void InitializeOptimizer()
+{
+    // Tear down the old managers outermost first: each one's proxies refer to
+    // the managers nested inside it.
+    TheFPM.reset();
+    TheMAM.reset();
+    TheCGAM.reset();
+    TheFAM.reset();
+    TheLAM.reset();
+
+    if (!ThePB) {
+        TheTM = ExitOnErr(TheJTMB->createTargetMachine());
+        ThePIC = std::make_unique<PassInstrumentationCallbacks>();
+        if (TimingPhases)
+            RegisterPassTimers(*ThePIC);
+        ThePB = std::make_unique<PassBuilder>(TheTM.get(), PipelineTuningOptions(), None,
+                                              ThePIC.get());
+    }
+
+    TheLAM = std::make_unique<LoopAnalysisManager>();
+    TheFAM = std::make_unique<FunctionAnalysisManager>();
+    TheCGAM = std::make_unique<CGSCCAnalysisManager>();
+    TheMAM = std::make_unique<ModuleAnalysisManager>();
+    ThePB->registerModuleAnalyses(*TheMAM);
+    ThePB->registerCGSCCAnalyses(*TheCGAM);
+    ThePB->registerFunctionAnalyses(*TheFAM);
+    ThePB->registerLoopAnalyses(*TheLAM);
+    ThePB->crossRegisterProxies(*TheLAM, *TheFAM, *TheCGAM, *TheMAM);
+
+    if (!BatchMode && !LazyCompile)
+        TheFPM = BuildFunctionPipeline();
+}
+
+/// OptimizeModule - Run LLVM's whole-module pipeline for the chosen level over
+/// the current module, so calls can be inlined across functions.
+static void OptimizeModule()
+{
+    PhaseRegion Region(PH_Optimize);
+    ModulePassManager MPM = OptLevel == '0'
+                            ? ThePB->buildO0DefaultPipeline(OptimizationLevel::O0)
+                            : ThePB->buildPerModuleDefaultPipeline(getOptimizationLevel());
+    MPM.run(*TheModule, *TheMAM);
+}
+
+/// OptimizePartition - With -lazy, optimise the part of a module the JIT is
+/// about to compile: usually the one function that has just been called, and
+/// declarations of whatever it uses.  It gets the whole-module pipeline in batch
+/// mode and otherwise the function pipeline, as it would have had eagerly, and
+/// analysis managers of its own, as it does not belong to the current module.
+static void OptimizePartition(Module &M)
+{
+    PhaseRegion Region(PH_Optimize);
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    ThePB->registerModuleAnalyses(MAM);
+    ThePB->registerCGSCCAnalyses(CGAM);
+    ThePB->registerFunctionAnalyses(FAM);
+    ThePB->registerLoopAnalyses(LAM);
+    ThePB->crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    ModulePassManager MPM;
+    if (!BatchMode) {
+        if (auto FPM = BuildFunctionPipeline())
+            MPM.addPass(createModuleToFunctionPassAdaptor(std::move(*FPM)));
+    } else if (OptLevel == '0') {
+        MPM = ThePB->buildO0DefaultPipeline(OptimizationLevel::O0);
+    } else {
+        MPM = ThePB->buildPerModuleDefaultPipeline(getOptimizationLevel());
+    }
+    MPM.run(M, MAM);
+}
+
+/*--------------------------------------------------------------------------------
+ * Interpreter
+ *------------------------------------------------------------------------------*/
+// A compact evaluator for short scripts and cold starts: each function is
+// compiled from its AST into register bytecode and run by a direct-threaded
+// dispatch loop, without bringing up LLVM at all.
+static cl::opt<bool> UseInterpreter("interp",
+        cl::desc("Run everything with the bytecode interpreter instead of the JIT"));
+
+/// BCOpcode - The bytecode instructions.  Dst, A and B are register numbers
+/// unless noted otherwise.
+enum BCOpcode : uint8_t
+{
+    BC_Const,       // Dst = Constants[A]
+    BC_Add,         // Dst = A + B
+    BC_Sub,         // Dst = A - B
+    BC_Mul,         // Dst = A * B
+    BC_Lt,          // Dst = A < B (unordered counts as less, like fcmp ult)
+    BC_Call,        // Dst = Callees[A](ArgRegs[B...])
+    BC_CallHost,    // Dst = Hosts[A](ArgRegs[B...])
+    BC_Move,        // Dst = A
+    BC_Branch,      // if A is neither zero nor NaN, continue at instruction B
+    BC_Ret,         // return A
+};
+
+/// BCInst - One instruction.  Handler is the address of the code that runs it,
+/// filled in the first time its function runs.
+struct BCInst
+{
+    const void *Handler;
+    BCOpcode Op;
+    uint32_t Dst, A, B;
+};
+
+/// HostFunction - A function of the host process called through an extern.
+struct HostFunction
+{
+    void *Addr;
+    unsigned NumArgs;
+    SymbolID Name;
+};
+
+/// BCFunction - The bytecode of one function.  Its arguments arrive in
+/// registers 0 to NumArgs - 1.  Unless it is Mutable, every other register is
+/// written by exactly one instruction, which runs at most once.
+struct BCFunction
+{
+    SymbolID Name;
+    unsigned NumArgs = 0;
+    unsigned NumRegs = 0;
+    std::vector<BCInst> Code;
+    std::vector<double> Constants;
+    std::vector<uint32_t> ArgRegs;              // Argument lists of the calls
+    std::vector<const BCFunction *> Callees;
+    std::vector<HostFunction> Hosts;
+    bool Threaded = false;                      // Handlers filled in
+    bool Tierable = false;                      // A definition, kept for good
+    bool Mutable = false;                       // Has moves or branches
+
+    // Tiered execution: how often the function has been interpreted, and its
+    // native code once that has been compiled, called with the arguments in an
+    // array.
+    mutable unsigned CallCount = 0;
+    mutable std::atomic<double (*)(const double *)> Native{nullptr};
+};
+
+static void RequestTierUp(const BCFunction &F);
+
+/// MaxHostArgs - The most arguments a host function may be called with.
+static const unsigned MaxHostArgs = 6;
+
+/// BCCompiler - Lowers the AST of one function to bytecode.
+class BCCompiler
+{
+    BCFunction &F;
+    DenseMap<SymbolID, uint32_t> VarRegs;               // Each variable in scope
+    DenseMap<const ExprAST *, uint32_t> SharedRegs;     // Like SharedValues
+
+    /// MutableRegs - The registers of the variables that can change: those bound
+    /// by for and var and the arguments assigned to.  Reading one copies it, so
+    /// that the value read stays put if the variable is assigned before it is
+    /// used.
+    DenseSet<uint32_t> MutableRegs;
+
+    uint32_t newReg() { return F.NumRegs++; }
+
+    void emit(BCOpcode Op, uint32_t Dst, uint32_t A, uint32_t B)
+    {
+        F.Code.push_back({nullptr, Op, Dst, A, B});
+        if (Op == BC_Move || Op == BC_Branch)
+            F.Mutable = true;
+    }
+
+    uint32_t emitConst(double Val)
+    {
+        uint32_t Reg = newReg();
+        emit(BC_Const, Reg, F.Constants.size(), 0);
+        F.Constants.push_back(Val);
+        return Reg;
+    }
+
+    /// bindVariable - Give Name a new mutable register holding the value in Init,
+    /// returning the register it had before, or ~0u if it had none.  Shared
+    /// subexpressions reading Name may read something else from here on.
+    uint32_t bindVariable(SymbolID Name, uint32_t Init)
+    {
+        SharedRegs.clear();
+        uint32_t Reg = newReg();
+        emit(BC_Move, Reg, Init, 0);
+        MutableRegs.insert(Reg);
+        auto Inserted = VarRegs.insert({Name, Reg});
+        uint32_t Old = Inserted.second ? ~0u : Inserted.first->second;
+        Inserted.first->second = Reg;
+        return Old;
+    }
+
+    /// restoreVariable - Undo bindVariable, given the register it returned.
+    void restoreVariable(SymbolID Name, uint32_t Old)
+    {
+        SharedRegs.clear();
+        if (Old == ~0u)
+            VarRegs.erase(Name);
+        else
+            VarRegs[Name] = Old;
+    }
+
+    bool resolveCall(SymbolID Callee, size_t NumArgs, BCOpcode &Op, uint32_t &Index);
+    bool compileCall(CallExprAST &Call, uint32_t &Result);
+    bool compileFor(ForExprAST &For, uint32_t &Result);
+    bool compileVar(VarExprAST &Var, uint32_t &Result);
+
+public:
+    BCCompiler(BCFunction &F, ArrayRef<SymbolID> Args, ArrayRef<SymbolID> Assigned) : F(F)
+    {
+        F.NumArgs = F.NumRegs = Args.size();
+        for (unsigned Idx = 0; Idx != Args.size(); ++Idx) {
+            VarRegs[Args[Idx]] = Idx;
+            if (is_contained(Assigned, Args[Idx]))
+                MutableRegs.insert(Idx);
+        }
+    }
+
+    /// compile - Emit code computing E; Result is the register holding it.
+    /// Returns false after reporting an error.
+    bool compile(ExprAST *E, uint32_t &Result);
+
+    /// compileFlat - Emit code computing E, in one pass over its nodes.  The code
+    /// is what compile would emit for the tree.
+    bool compileFlat(const FlatExpr &E, uint32_t &Result);
+
+    /// compileBody - Emit code returning the value of Body.
+    bool compileBody(ExprAST *Body)
+    {
+        uint32_t Result;
+        bool Compiled;
+        if (FlatAST && FlatBody.assign(Body)) {
+            Compiled = compileFlat(FlatBody, Result);
+        } else {
+            Compiled = compile(Body, Result);
+        }
+        if (!Compiled)
+            return false;
+        emit(BC_Ret, 0, Result, 0);
+        return true;
+    }
+};
+
+/// Interpreter - The functions and externs known to the bytecode interpreter.
+class Interpreter
+{
+    DenseMap<SymbolID, std::unique_ptr<BCFunction>> Functions;
+    DenseMap<SymbolID, unsigned> Externs;       // Name to argument count
+
+public:
+    const BCFunction *getFunction(SymbolID Name) const
+    {
+        auto It = Functions.find(Name);
+        return It == Functions.end() ? nullptr : It->second.get();
+    }
+
+    /// getExtern - Look up an extern declared with NumArgs arguments, or
+    /// return false after reporting why it cannot be called.
+    bool getExtern(SymbolID Name, unsigned NumArgs, HostFunction &Result) const
+    {
+        auto It = Externs.find(Name);
+        if (It == Externs.end()) {
+            LogError("Unknown function referenced");
+            return false;
+        }
+        if (It->second != NumArgs) {
+            LogError("Incorrect # arguments passed");
+            return false;
+        }
+        if (NumArgs > MaxHostArgs) {
+            LogError("too many arguments for a host function");
+            return false;
+        }
+        void *Addr = LookupHostFunction(Symbols.getName(Name));
+        if (!Addr) {
+            fprintf(stderr, "Error, host function '%s' not found\n",
+                    Symbols.getName(Name).str().c_str());
+            return false;
+        }
+        Result = {Addr, NumArgs, Name};
+        return true;
+    }
+
+    void addExtern(PrototypeAST &Proto) { Externs[Proto.getName()] = Proto.getArgs().size(); }
+
+    /// compile - Compile Fn to bytecode, without making it callable.
+    static std::unique_ptr<BCFunction> compile(FunctionAST &Fn);
+
+    /// define - Compile a definition and add it to the known functions.
+    const BCFunction *define(FunctionAST &Fn);
+
+    /// run - Interpret F on the arguments in Args.
+    static double run(const BCFunction &F, const double *Args);
+};
+
+static Interpreter TheInterpreter;
+
+bool BCCompiler::compile(ExprAST *E, uint32_t &Result)
+{
+    if (E->isShared()) {
+        auto It = SharedRegs.find(E);
+        if (It != SharedRegs.end()) {
+            Result = It->second;
+            return true;
+        }
+    }
+
+    switch (E->getKind()) {
+        case ExprAST::EK_Number:
+            Result = emitConst(llvm::cast<NumberExprAST>(E)->getVal());
+            break;
+        case ExprAST::EK_Variable: {
+            auto It = VarRegs.find(llvm::cast<VariableExprAST>(E)->getName());
+            if (It == VarRegs.end()) {
+                LogError("Unknown variable name");
+                return false;
+            }
+            Result = It->second;
+            if (MutableRegs.count(Result)) {
+                Result = newReg();
+                emit(BC_Move, Result, It->second, 0);
+            }
+            break;
+        }
+        case ExprAST::EK_Binary: {
+            auto *Bin = llvm::cast<BinaryExprAST>(E);
+            if (Bin->getOp() == '=') {
+                auto *Dest = llvm::dyn_cast<VariableExprAST>(Bin->getLHS());
+                if (!Dest) {
+                    LogError("destination of '=' must be a variable");
+                    return false;
+                }
+                if (!compile(Bin->getRHS(), Result))
+                    return false;
+                auto It = VarRegs.find(Dest->getName());
+                if (It == VarRegs.end()) {
+                    LogError("Unknown variable name");
+                    return false;
+                }
+                emit(BC_Move, It->second, Result, 0);
+                SharedRegs.clear();
+                break;
+            }
+            uint32_t L, R;
+            if (!compile(Bin->getLHS(), L) || !compile(Bin->getRHS(), R))
+                return false;
+            BCOpcode Op;
+            switch (Bin->getOp()) {
+                case '+': Op = BC_Add; break;
+                case '-': Op = BC_Sub; break;
+                case '*': Op = BC_Mul; break;
+                case '<': Op = BC_Lt; break;
+                default:
+                    LogError("invalid binary operator");
+                    return false;
+            }
+            Result = newReg();
+            emit(Op, Result, L, R);
+            break;
+        }
+        case ExprAST::EK_Call:
+            if (!compileCall(*llvm::cast<CallExprAST>(E), Result))
+                return false;
+            break;
+        case ExprAST::EK_For:
+            if (!compileFor(*llvm::cast<ForExprAST>(E), Result))
+                return false;
+            break;
+        case ExprAST::EK_Var:
+            if (!compileVar(*llvm::cast<VarExprAST>(E), Result))
+                return false;
+            break;
+    }
+
+    if (E->isShared())
+        SharedRegs[E] = Result;
+    return true;
+}
+
+/// compileFor - Emit a for loop as the JIT does: the body, step and end
+/// condition, then the increment and a branch back, so the body always runs
+/// at least once.
+bool BCCompiler::compileFor(ForExprAST &For, uint32_t &Result)
+{
+    uint32_t Start;
+    if (!compile(For.getStart(), Start))
+        return false;
+    // Binding the variable also forgets the shared registers computed before
+    // the loop, which may be stale in it.
+    uint32_t Old = bindVariable(For.getVarName(), Start);
+    uint32_t Var = VarRegs[For.getVarName()];
+    uint32_t Loop = F.Code.size();
+
+    uint32_t Body, Step, End;
+    if (!compile(For.getBody(), Body))
+        return false;
+    if (For.getStep()) {
+        if (!compile(For.getStep(), Step))
+            return false;
+    } else {
+        Step = emitConst(1.0);
+    }
+    if (!compile(For.getEnd(), End))
+        return false;
+    emit(BC_Add, Var, Var, Step);
+    emit(BC_Branch, 0, End, Loop);
+
+    restoreVariable(For.getVarName(), Old);
+    Result = emitConst(0.0);
+    return true;
+}
+
+bool BCCompiler::compileVar(VarExprAST &Var, uint32_t &Result)
+{
+    SmallVector<uint32_t, 4> Old;
+    for (const VarBinding &B : Var.getVars()) {
+        // The initializer does not see the variable it initializes.
+        uint32_t Init;
+        if (!B.Init)
+            Init = emitConst(0.0);
+        else if (!compile(B.Init, Init))
+            return false;
+        Old.push_back(bindVariable(B.Name, Init));
+    }
+
+    if (!compile(Var.getBody(), Result))
+        return false;
+
+    for (size_t I = Var.getVars().size(); I-- != 0;)
+        restoreVariable(Var.getVars()[I].Name, Old[I]);
+    return true;
+}
+
+/// resolveCall - Find the function a call to Callee with NumArgs arguments
+/// makes, setting Op to the instruction for it and Index to its entry in
+/// F.Callees or F.Hosts.  Returns false after reporting an error.
+bool BCCompiler::resolveCall(SymbolID Callee, size_t NumArgs, BCOpcode &Op, uint32_t &Index)
+{
+    // Definitions, this one included, take precedence over host functions.
+    const BCFunction *Def = Callee == F.Name ? &F : TheInterpreter.getFunction(Callee);
+    if (Def) {
+        if (Def->NumArgs != NumArgs) {
+            LogError("Incorrect # arguments passed");
+            return false;
+        }
+        Op = BC_Call;
+        Index = F.Callees.size();
+        F.Callees.push_back(Def);
+        return true;
+    }
+
+    HostFunction Host;
+    if (!TheInterpreter.getExtern(Callee, NumArgs, Host))
+        return false;
+    Op = BC_CallHost;
+    Index = F.Hosts.size();
+    F.Hosts.push_back(Host);
+    return true;
+}
+
+bool BCCompiler::compileCall(CallExprAST &Call, uint32_t &Result)
+{
+    ArrayRef<ExprAST *> Args = Call.getArgs();
+    BCOpcode Op;
+    uint32_t Callee;
+    if (!resolveCall(Call.getCallee(), Args.size(), Op, Callee))
+        return false;
+
+    std::vector<uint32_t> Regs;
+    for (ExprAST *Arg : Args) {
+        uint32_t Reg;
+        if (!compile(Arg, Reg))
+            return false;
+        Regs.push_back(Reg);
+    }
+    uint32_t First = F.ArgRegs.size();
+    F.ArgRegs.insert(F.ArgRegs.end(), Regs.begin(), Regs.end());
+
+    Result = newReg();
+    emit(Op, Result, Callee, First);
+    return true;
+}
+
+bool BCCompiler::compileFlat(const FlatExpr &E, uint32_t &Result)
+{
+    std::vector<uint32_t> Regs(E.size());
+    SmallVector<std::pair<BCOpcode, uint32_t>, 8> Callees(E.Calls.size());
+    size_t NextCall = 0;
+    for (uint32_t I = 0; I != E.size(); ++I) {
+        // Resolve each callee where the tree walk would, so the callee tables
+        // come out in the same order.
+        for (; NextCall != E.Calls.size() && E.Calls[NextCall].Start == I; ++NextCall) {
+            const FlatExpr::FlatCall &C = E.Calls[NextCall];
+            if (!resolveCall(C.Callee, C.NumArgs, Callees[NextCall].first,
+                             Callees[NextCall].second))
+                return false;
+        }
+
+        switch (E.getKind(I)) {
+            case ExprAST::EK_Number:
+                Regs[I] = newReg();
+                emit(BC_Const, Regs[I], F.Constants.size(), 0);
+                F.Constants.push_back(E.Numbers[E.A[I]]);
+                break;
+            case ExprAST::EK_Variable: {
+                auto It = VarRegs.find(E.A[I]);
+                if (It == VarRegs.end()) {
+                    LogError("Unknown variable name");
+                    return false;
+                }
+                Regs[I] = It->second;
+                break;
+            }
+            case ExprAST::EK_Binary: {
+                BCOpcode Op;
+                switch (E.Ops[I]) {
+                    case '+': Op = BC_Add; break;
+                    case '-': Op = BC_Sub; break;
+                    case '*': Op = BC_Mul; break;
+                    case '<': Op = BC_Lt; break;
+                    default:
+                        LogError("invalid binary operator");
+                        return false;
+                }
+                Regs[I] = newReg();
+                emit(Op, Regs[I], Regs[E.A[I]], Regs[E.B[I]]);
+                break;
+            }
+            case ExprAST::EK_Call: {
+                uint32_t First = F.ArgRegs.size();
+                for (uint32_t Arg : E.getArgs(E.Calls[E.A[I]]))
+                    F.ArgRegs.push_back(Regs[Arg]);
+                Regs[I] = newReg();
+                emit(Callees[E.A[I]].first, Regs[I], Callees[E.A[I]].second, First);
+                break;
+            }
+            case ExprAST::EK_For:
+            case ExprAST::EK_Var:
+                llvm_unreachable("not in a flat layout");
+        }
+    }
+    Result = Regs.back();
+    return true;
+}
+
+/// CallHost - Call a host function with N (at most MaxHostArgs) arguments.
+static double CallHost(const HostFunction &Fn, const double *A)
+{
+    typedef double D;
+    switch (Fn.NumArgs) {
+        case 0: return ((D (*)())Fn.Addr)();
+        case 1: return ((D (*)(D))Fn.Addr)(A[0]);
+        case 2: return ((D (*)(D, D))Fn.Addr)(A[0], A[1]);
+        case 3: return ((D (*)(D, D, D))Fn.Addr)(A[0], A[1], A[2]);
+        case 4: return ((D (*)(D, D, D, D))Fn.Addr)(A[0], A[1], A[2], A[3]);
+        case 5: return ((D (*)(D, D, D, D, D))Fn.Addr)(A[0], A[1], A[2], A[3], A[4]);
+        default: return ((D (*)(D, D, D, D, D, D))Fn.Addr)(A[0], A[1], A[2], A[3], A[4], A[5]);
+    }
+}
+
+static cl::opt<bool> Tiered("tiered",
+        cl::desc("Start every function in the bytecode interpreter and compile the "
+                 "hot ones to native code in the background (implies -interp)"));
+
+static cl::opt<unsigned> TierThreshold("tier-threshold",
+        cl::desc("Interpreted calls after which -tiered compiles a function; 1 "
+                 "compiles it on its first call (default = 1000)"),
+        cl::init(1000));
+
+double Interpreter::run(const BCFunction &F, const double *Args)
+{
+    if (Tiered && ++F.CallCount == TierThreshold)
+        RequestTierUp(F);
+
+    SmallVector<double, 32> Regs(F.NumRegs);
+    std::copy(Args, Args + F.NumArgs, Regs.begin());
+    double *R = Regs.data();
+    const BCInst *I = F.Code.data();
+
+#if defined(__GNUC__)
+    // Direct threading: every instruction jumps straight to the handler of the
+    // next, which is stored in the instruction itself.
+    static const void *const Handlers[] = {
+        &&Op_Const, &&Op_Add, &&Op_Sub, &&Op_Mul, &&Op_Lt, &&Op_Call, &&Op_CallHost,
+        &&Op_Move, &&Op_Branch, &&Op_Ret,
+    };
+    if (!F.Threaded) {
+        auto &Code = const_cast<BCFunction &>(F);
+        for (BCInst &Inst : Code.Code)
+            Inst.Handler = Handlers[Inst.Op];
+        Code.Threaded = true;
+    }
+#define NEXT() goto *I->Handler
+#define OP(Name) case BC_##Name: Op_##Name:
+    NEXT();
+#else
+#define NEXT() goto Dispatch
+#define OP(Name) case BC_##Name:
+Dispatch:
+#endif
+    switch (I->Op) {
+        OP(Const)
+            R[I->Dst] = F.Constants[I->A];
+            ++I;
+            NEXT();
+        OP(Add)
+            R[I->Dst] = R[I->A] + R[I->B];
+            ++I;
+            NEXT();
+        OP(Sub)
+            R[I->Dst] = R[I->A] - R[I->B];
+            ++I;
+            NEXT();
+        OP(Mul)
+            R[I->Dst] = R[I->A] * R[I->B];
+            ++I;
+            NEXT();
+        OP(Lt)
+            R[I->Dst] = !(R[I->A] >= R[I->B]) ? 1.0 : 0.0;
+            ++I;
+            NEXT();
+        OP(Call) {
+            const BCFunction &Callee = *F.Callees[I->A];
+            SmallVector<double, 8> Args;
+            for (unsigned Idx = 0; Idx != Callee.NumArgs; ++Idx)
+                Args.push_back(R[F.ArgRegs[I->B + Idx]]);
+            auto *Native = Callee.Native.load(std::memory_order_acquire);
+            R[I->Dst] = Native ? Native(Args.data()) : run(Callee, Args.data());
+            ++I;
+            NEXT();
+        }
+        OP(CallHost) {
+            const HostFunction &Host = F.Hosts[I->A];
+            double Args[MaxHostArgs];
+            for (unsigned Idx = 0; Idx != Host.NumArgs; ++Idx)
+                Args[Idx] = R[F.ArgRegs[I->B + Idx]];
+            R[I->Dst] = CallHost(Host, Args);
+            ++I;
+            NEXT();
+        }
+        OP(Move)
+            R[I->Dst] = R[I->A];
+            ++I;
+            NEXT();
+        OP(Branch)
+            // Like fcmp one: a NaN condition is false.
+            I = R[I->A] < 0.0 || R[I->A] > 0.0 ? F.Code.data() + I->B : I + 1;
+            NEXT();
+        OP(Ret)
+            return R[I->A];
+    }
+#undef NEXT
+#undef OP
+    return 0;
+}
+
+/*--------------------------------------------------------------------------------
+ * JIT
+ *------------------------------------------------------------------------------*/
+static void InitializeModule()
+{
+    // Open a new context and module.  A module still left over from a parallel
+    // compile job must go before the context that owns it.
+    TheModule.reset();
+    TheContext = std::make_unique<LLVMContext>();
+    TheModule = std::make_unique<Module>("my cool jit", *TheContext);
+    TheModule->setDataLayout(TheJIT->getDataLayout());
+
+    // Create a new builder for the module.
+    Builder = std::make_unique<IRBuilder<>>(*TheContext);
+
+    // Create new pass and analysis managers.
+    InitializeOptimizer();
+}
+
+static cl::opt<std::string> CacheDir("cache-dir",
+        cl::desc("Keep the object code of each definition in this directory and "
+                 "reuse it whenever the same definition is compiled again"),
+        cl::value_desc("directory"));
+
+/// CompileCache - An ObjectCache that stores object files on disk, one per
+/// definition, named by the hash of its tokens (see CacheKeyFor).  Only modules
+/// whose identifier is such a key are cached.
+class CompileCache : public ObjectCache
+{
+    std::string Dir;
+
+    void getPath(StringRef Key, SmallVectorImpl<char> &Path) const
+    {
+        Path.assign(Dir.begin(), Dir.end());
+        sys::path::append(Path, Key + ".o");
+    }
+
+public:
+    static constexpr const char *KeyPrefix = "kdef-";
+
+    CompileCache(std::string Dir) : Dir(std::move(Dir)) {}
+
+    /// lookup - The object file cached under Key, or null.
+    std::unique_ptr<MemoryBuffer> lookup(StringRef Key) const
+    {
+        SmallString<128> Path;
+        getPath(Key, Path);
+        auto Buf = MemoryBuffer::getFile(Path, /*IsText=*/false,
+                                         /*RequiresNullTerminator=*/false);
+        return Buf ? std::move(*Buf) : nullptr;
+    }
+
+    void notifyObjectCompiled(const Module *M, MemoryBufferRef Obj) override
+    {
+        StringRef Key = M->getModuleIdentifier();
+        if (!Key.startswith(KeyPrefix))
+            return;
+
+        // Write to a file of our own and rename it into place, so that another
+        // process never sees a half-written object.
+        SmallString<128> Path, TmpPath;
+        getPath(Key, Path);
+        int FD;
+        if (sys::fs::createUniqueFile(Path + ".%%%%%%.tmp", FD, TmpPath))
+            return;
+        {
+            raw_fd_ostream OS(FD, /*shouldClose=*/true);
+            OS << Obj.getBuffer();
+            OS.close();
+            if (OS.has_error()) {
+                OS.clear_error();
+                sys::fs::remove(TmpPath);
+                return;
+            }
+        }
+        if (sys::fs::rename(TmpPath, Path))
+            sys::fs::remove(TmpPath);
+    }
+
+    std::unique_ptr<MemoryBuffer> getObject(const Module *M) override
+    {
+        StringRef Key = M->getModuleIdentifier();
+        return Key.startswith(KeyPrefix) ? lookup(Key) : nullptr;
+    }
+};
+
+static std::unique_ptr<CompileCache> TheCache;
+
+/// LazyCompileFailed - With -lazy, where a call ends up instead if the function
+/// called could not be compiled, once the JIT has reported why.  All functions
+/// return a double, so the caller gets a NaN and carries on.
+static double LazyCompileFailed()
+{
+    fprintf(stderr, "Error, called a function that could not be compiled\n");
+    return std::numeric_limits<double>::quiet_NaN();
+}
+
+/// HostSymbolGenerator - Resolves the symbols JIT'd code needs from the host
+/// process through LookupHostFunction, so the JIT binds an extern to the same
+/// function the interpreter would.
+class HostSymbolGenerator : public DefinitionGenerator
+{
+    char GlobalPrefix;
+
+public:
+    explicit HostSymbolGenerator(char GlobalPrefix) : GlobalPrefix(GlobalPrefix) {}
+
+    Error tryToGenerate(LookupState &, LookupKind, JITDylib &JD, JITDylibLookupFlags,
+                        const SymbolLookupSet &Syms) override
+    {
+        SymbolMap NewDefs;
+        for (const auto &KV : Syms) {
+            StringRef Name = *KV.first;
+            if (GlobalPrefix && !Name.consume_front(StringRef(&GlobalPrefix, 1)))
+                continue;
+            if (void *Addr = LookupHostFunction(Name))
+                NewDefs[KV.first] = JITEvaluatedSymbol(pointerToJITTargetAddress(Addr),
+                                                       JITSymbolFlags::Exported);
+        }
+        if (NewDefs.empty())
+            return Error::success();
+        return JD.define(absoluteSymbols(std::move(NewDefs)));
+    }
+};
+
+/// InitializeJIT - Bring up the native target and an LLJIT whose main dylib
+/// also resolves symbols from the host process, through HostSymbols.  With
+/// -lazy it is an LLLazyJIT instead, which compiles each function on its own,
+/// behind a lazy call-through stub, the first time the function is called.
+static void InitializeJIT()
+{
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+    InitializeNativeTargetAsmParser();
+
+    auto JTMB = ExitOnErr(JITTargetMachineBuilder::detectHost());
+    JTMB.setCodeGenOptLevel(getCodeGenOptLevel());
+    TheJTMB = std::make_unique<JITTargetMachineBuilder>(JTMB);
+
+    if (LazyCompile) {
+        LLLazyJITBuilder JITBuilder;
+        JITBuilder.setJITTargetMachineBuilder(std::move(JTMB));
+        JITBuilder.setLazyCompileFailureAddr(pointerToJITTargetAddress(&LazyCompileFailed));
+        auto LazyJIT = ExitOnErr(JITBuilder.create());
+        LazyJIT->setPartitionFunction(CompileOnDemandLayer::compileRequested);
+        TheJIT = std::move(LazyJIT);
+
+        // Compilation happens on the thread that made the first call, which
+        // is the main thread, so the partition can use its PassBuilder.
+        TheJIT->getIRTransformLayer().setTransform(
+                [](ThreadSafeModule TSM, const MaterializationResponsibility &)
+                        -> Expected<ThreadSafeModule> {
+                    TSM.withModuleDo(OptimizePartition);
+                    return TSM;
+                });
+    } else {
+        LLJITBuilder JITBuilder;
+        JITBuilder.setJITTargetMachineBuilder(std::move(JTMB));
+        if (!CacheDir.empty()) {
+            if (std::error_code EC = sys::fs::create_directories(CacheDir)) {
+                fprintf(stderr, "Error, cannot create cache directory '%s': %s\n",
+                        CacheDir.c_str(), EC.message().c_str());
+            } else {
+                TheCache = std::make_unique<CompileCache>(CacheDir);
+                JITBuilder.setCompileFunctionCreator(
+                        [](JITTargetMachineBuilder JTMB)
+                                -> Expected<std::unique_ptr<IRCompileLayer::IRCompiler>> {
+                            auto TM = JTMB.createTargetMachine();
+                            if (!TM)
+                                return TM.takeError();
+                            return std::make_unique<TMOwningSimpleCompiler>(std::move(*TM),
+                                                                            TheCache.get());
+                        });
+            }
+        }
+        TheJIT = ExitOnErr(JITBuilder.create());
+    }
+    TheJIT->getMainJITDylib().addGenerator(
+            std::make_unique<HostSymbolGenerator>(TheJIT->getDataLayout().getGlobalPrefix()));
+}
+
+/// AddIRToJIT - Hand TSM to the JIT, tracked by RT, or by the main dylib's
+/// default tracker if RT is null.  With -lazy, a module added Lazily is only
+/// compiled function by function, as each is called; a top-level expression is
+/// still compiled straight away.  Returns false (after reporting why) if the
+/// JIT refused it, e.g. for a duplicate definition.
+static bool AddIRToJIT(ThreadSafeModule TSM, ResourceTrackerSP RT, bool Lazily)
+{
+    PhaseRegion Region(PH_Materialize);
+    if (!RT)
+        RT = TheJIT->getMainJITDylib().getDefaultResourceTracker();
+    Error Err = Lazily && LazyCompile
+                ? static_cast<LLLazyJIT &>(*TheJIT).getCompileOnDemandLayer().add(
+                        std::move(RT), std::move(TSM))
+                : TheJIT->addIRModule(std::move(RT), std::move(TSM));
+    if (Err) {
+        logAllUnhandledErrors(std::move(Err), errs(), "Error, ");
+        return false;
+    }
+    return true;
+}
+
+/// LookupSymbol - Look Name up in the JIT, compiling it and whatever it needs
+/// first if that has not happened yet.
+static Expected<JITEvaluatedSymbol> LookupSymbol(StringRef Name)
+{
+    PhaseRegion Region(PH_Materialize);
+    return TheJIT->lookup(Name);
+}
+
+/// AddModuleToJIT - Hand the current module to the JIT, as AddIRToJIT does,
+/// and start a fresh module for the next item.
+static bool AddModuleToJIT(ResourceTrackerSP RT = nullptr, bool Lazily = false)
+{
+    ThreadSafeModule TSM(std::move(TheModule), std::move(TheContext));
+    InitializeModule();
+    return AddIRToJIT(std::move(TSM), std::move(RT), Lazily);
+}
+
+/// MillisecondsSince - Wall-clock time elapsed since Start, in milliseconds.
+static double MillisecondsSince(std::chrono::steady_clock::time_point Start)
+{
+    return std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - Start).count();
+}
+
+/// EvaluateBatch - For hosts embedding the JIT: run the compiled definition Name
+/// over N rows of input, one column of N doubles per argument, writing row i's
+/// result to Out[i].  Needs -batch-wrappers; returns false (after reporting
+/// why) if Name has no wrapper or takes a different number of arguments.
+bool EvaluateBatch(StringRef Name, ArrayRef<const double *> Cols, double *Out, size_t N)
+{
+    PrototypeAST *Proto = FunctionProtos.lookup(Symbols.intern(Name));
+    if (!Proto || Proto->getArgs().size() != Cols.size()) {
+        fprintf(stderr, "Error, '%s' does not take %zu arguments\n", Name.str().c_str(),
+                Cols.size());
+        return false;
+    }
+
+    auto Wrapper = LookupSymbol((Name + ".batch").str());
+    if (!Wrapper) {
+        logAllUnhandledErrors(Wrapper.takeError(), errs(), "Error, ");
+        return false;
+    }
+    auto *FP = (void (*)(const double *const *, double *, uint64_t))(intptr_t)
+            Wrapper->getAddress();
+    FP(Cols.data(), Out, N);
+    return true;
+}
+
+/*--------------------------------------------------------------------------------
+ * Tiered execution
+ *------------------------------------------------------------------------------*/
+// With -tiered, functions start out in the interpreter.  Once one has been
+// called TierThreshold times, its bytecode is translated to LLVM IR, optimised
+// and JIT-compiled on a background thread, and then swapped in: interpreted
+// callers see BCFunction::Native, and native callers call through an ORC
+// indirect stub that is repointed from the interpreter to the new code.
+
+/// TierJob - A function to compile, with every name it needs looked up on the
+/// main thread, as the interner may grow while the job runs.
+struct TierJob
+{
+    const BCFunction *F;
+    std::string Name;
+    std::vector<std::string> CalleeNames;   // Parallel to F->Callees
+    std::vector<std::string> HostNames;     // Parallel to F->Hosts
+};
+
+/// TierPool - The background thread jobs run on.  The JIT is only brought up
+/// there, when the first function gets hot, and only that thread touches it
+/// and the stubs.
+static std::unique_ptr<ThreadPool> TierPool;
+static std::atomic<bool> TierShutdown{false};
+static std::unique_ptr<IndirectStubsManager> TheStubs;
+static DenseSet<const BCFunction *> Stubbed;
+
+/// InterpretFromNative - Where the stub of a function without native code
+/// leads: run it in the interpreter.
+static double InterpretFromNative(const BCFunction *F, const double *Args)
+{
+    auto *Native = F->Native.load(std::memory_order_acquire);
+    return Native ? Native(Args) : Interpreter::run(*F, Args);
+}
+
+static FunctionType *getDoubleFnTy(unsigned NumArgs)
+{
+    Type *DoubleTy = Type::getDoubleTy(*TheContext);
+    return FunctionType::get(DoubleTy, std::vector<Type *>(NumArgs, DoubleTy), false);
+}
+
+/// EmitInterpreterTrampoline - Define Name.interp, with F's native signature,
+/// to pass its arguments to InterpretFromNative.
+static void EmitInterpreterTrampoline(const BCFunction &F, StringRef Name)
+{
+    LLVMContext &Ctx = *TheContext;
+    Type *DoubleTy = Type::getDoubleTy(Ctx);
+    Type *Int8PtrTy = Type::getInt8PtrTy(Ctx);
+    Function *T = Function::Create(getDoubleFnTy(F.NumArgs), Function::ExternalLinkage,
+                                   Name + ".interp", TheModule.get());
+    Builder->SetInsertPoint(BasicBlock::Create(Ctx, "entry", T));
+
+    ArrayType *ArgsTy = ArrayType::get(DoubleTy, std::max(F.NumArgs, 1u));
+    Value *Args = Builder->CreateAlloca(ArgsTy, nullptr, "args");
+    for (Argument &Arg : T->args())
+        Builder->CreateStore(&Arg, Builder->CreateConstInBoundsGEP2_64(ArgsTy, Args, 0,
+                                                                       Arg.getArgNo()));
+
+    FunctionCallee Entry = TheModule->getOrInsertFunction(
+            "kaleido.interp", DoubleTy, Int8PtrTy, DoubleTy->getPointerTo());
+    Value *FPtr = ConstantExpr::getIntToPtr(
+            ConstantInt::get(Type::getInt64Ty(Ctx), (uintptr_t)&F), Int8PtrTy);
+    Builder->CreateRet(Builder->CreateCall(
+            Entry, {FPtr, Builder->CreateConstInBoundsGEP2_64(ArgsTy, Args, 0, 0)}));
+}
+
+/// EmitNativeFunction - Translate the bytecode of a job's function to IR, as
+/// Name.native, along with Name.tier, which takes the arguments in an array for
+/// the interpreter to call.
+static void EmitNativeFunction(const TierJob &Job)
+{
+    const BCFunction &F = *Job.F;
+    LLVMContext &Ctx = *TheContext;
+    Type *DoubleTy = Type::getDoubleTy(Ctx);
+    Function *Fn = Function::Create(getDoubleFnTy(F.NumArgs), Function::ExternalLinkage,
+                                    Job.Name + ".native", TheModule.get());
+    Builder->SetInsertPoint(BasicBlock::Create(Ctx, "entry", Fn));
+
+    // Bytecode that assigns every register once maps straight to SSA.  Mutable
+    // bytecode gets a stack slot per register instead, which the optimiser
+    // promotes back to SSA values and phis.
+    std::vector<Value *> Regs(F.NumRegs);
+    if (F.Mutable) {
+        for (Value *&Slot : Regs)
+            Slot = Builder->CreateAlloca(DoubleTy);
+        for (Argument &Arg : Fn->args())
+            Builder->CreateStore(&Arg, Regs[Arg.getArgNo()]);
+    } else {
+        for (Argument &Arg : Fn->args())
+            Regs[Arg.getArgNo()] = &Arg;
+    }
+    auto Get = [&](uint32_t Reg) {
+        return F.Mutable ? Builder->CreateLoad(DoubleTy, Regs[Reg]) : Regs[Reg];
+    };
+    auto Set = [&](uint32_t Reg, Value *V) {
+        if (F.Mutable)
+            Builder->CreateStore(V, Regs[Reg]);
+        else
+            Regs[Reg] = V;
+    };
+    auto CallArgs = [&](uint32_t First, unsigned N) {
+        std::vector<Value *> Args;
+        for (unsigned Idx = 0; Idx != N; ++Idx)
+            Args.push_back(Get(F.ArgRegs[First + Idx]));
+        return Args;
+    };
+
+    // Every branch target starts a block.
+    DenseMap<uint32_t, BasicBlock *> Blocks;
+    for (const BCInst &I : F.Code)
+        if (I.Op == BC_Branch && !Blocks.count(I.B))
+            Blocks[I.B] = BasicBlock::Create(Ctx, "loop", Fn);
+
+    for (uint32_t Idx = 0; Idx != F.Code.size(); ++Idx) {
+        const BCInst &I = F.Code[Idx];
+        if (BasicBlock *BB = Blocks.lookup(Idx)) {
+            Builder->CreateBr(BB);
+            Builder->SetInsertPoint(BB);
+        }
+        switch (I.Op) {
+            case BC_Const:
+                Set(I.Dst, ConstantFP::get(DoubleTy, F.Constants[I.A]));
+                break;
+            case BC_Add:
+                Set(I.Dst, Builder->CreateFAdd(Get(I.A), Get(I.B), "addtmp"));
+                break;
+            case BC_Sub:
+                Set(I.Dst, Builder->CreateFSub(Get(I.A), Get(I.B), "subtmp"));
+                break;
+            case BC_Mul:
+                Set(I.Dst, Builder->CreateFMul(Get(I.A), Get(I.B), "multmp"));
+                break;
+            case BC_Lt:
+                Set(I.Dst, Builder->CreateUIToFP(
+                                   Builder->CreateFCmpULT(Get(I.A), Get(I.B), "cmptmp"),
+                                   DoubleTy, "booltmp"));
+                break;
+            case BC_Call: {
+                // Other definitions are called through their stubs.
+                const BCFunction &Callee = *F.Callees[I.A];
+                FunctionCallee Target = &Callee == &F
+                        ? FunctionCallee(Fn)
+                        : TheModule->getOrInsertFunction(Job.CalleeNames[I.A],
+                                                         getDoubleFnTy(Callee.NumArgs));
+                Set(I.Dst, Builder->CreateCall(Target, CallArgs(I.B, Callee.NumArgs),
+                                               "calltmp"));
+                break;
+            }
+            case BC_CallHost: {
+                unsigned N = F.Hosts[I.A].NumArgs;
+                Intrinsic::ID ID = LibmIntrinsics ? LibmIntrinsic(Job.HostNames[I.A], N)
+                                                  : Intrinsic::not_intrinsic;
+                FunctionCallee Target =
+                        ID ? Intrinsic::getDeclaration(TheModule.get(), ID, {DoubleTy})
+                           : TheModule->getOrInsertFunction(Job.HostNames[I.A],
+                                                            getDoubleFnTy(N));
+                Set(I.Dst, Builder->CreateCall(Target, CallArgs(I.B, N), "calltmp"));
+                break;
+            }
+            case BC_Move:
+                Set(I.Dst, Get(I.A));
+                break;
+            case BC_Branch: {
+                Value *Cond = Builder->CreateFCmpONE(
+                        Get(I.A), ConstantFP::get(DoubleTy, 0.0), "loopcond");
+                BasicBlock *After = BasicBlock::Create(Ctx, "afterloop", Fn);
+                Builder->CreateCondBr(Cond, Blocks[I.B], After);
+                Builder->SetInsertPoint(After);
+                break;
+            }
+            case BC_Ret:
+                Builder->CreateRet(Get(I.A));
+                break;
+        }
+    }
+    verifyFunction(*Fn);
+
+    Type *DoublePtrTy = DoubleTy->getPointerTo();
+    Function *Entry = Function::Create(FunctionType::get(DoubleTy, {DoublePtrTy}, false),
+                                       Function::ExternalLinkage, Job.Name + ".tier",
+                                       TheModule.get());
+    Builder->SetInsertPoint(BasicBlock::Create(Ctx, "entry", Entry));
+    std::vector<Value *> Args;
+    for (unsigned Idx = 0; Idx != F.NumArgs; ++Idx)
+        Args.push_back(Builder->CreateLoad(
+                DoubleTy, Builder->CreateConstInBoundsGEP1_64(DoubleTy, Entry->getArg(0), Idx)));
+    Builder->CreateRet(Builder->CreateCall(Fn, Args));
+}
+
+/// InitializeTieredJIT - Bring up the JIT and the stubs, and let native code
+/// call back into the interpreter.
+static void InitializeTieredJIT()
+{
+    InitializeJIT();
+    TheStubs = createLocalIndirectStubsManagerBuilder(TheJTMB->getTargetTriple())();
+    ExitOnErr(TheJIT->getMainJITDylib().define(absoluteSymbols(
+            {{TheJIT->mangleAndIntern("kaleido.interp"),
+              JITEvaluatedSymbol(pointerToJITTargetAddress(&InterpretFromNative),
+                                 JITSymbolFlags::Exported | JITSymbolFlags::Callable)}})));
+}
+
+/// LookupInJIT - The address of Name, or 0 after reporting why there is none.
+static JITTargetAddress LookupInJIT(StringRef Name)
+{
+    auto Sym = LookupSymbol(Name);
+    if (!Sym) {
+        logAllUnhandledErrors(Sym.takeError(), errs(), "Error, ");
+        return 0;
+    }
+    return Sym->getAddress();
+}
+
+/// TierUp - Compile a job's function to native code and switch it over.
+static void TierUp(const TierJob &Job)
+{
+    if (TierShutdown)
+        return;
+    auto Start = std::chrono::steady_clock::now();
+    if (!TheJIT)
+        InitializeTieredJIT();
+
+    // Give the function and everything it calls a stub first, leading to the
+    // interpreter, so that native code can call whatever is still interpreted.
+    InitializeModule();
+    std::vector<std::pair<std::string, const BCFunction *>> NewStubs;
+    auto NeedStub = [&](const BCFunction *G, const std::string &Name) {
+        if (Stubbed.insert(G).second) {
+            EmitInterpreterTrampoline(*G, Name);
+            NewStubs.push_back({Name, G});
+        }
+    };
+    NeedStub(Job.F, Job.Name);
+    for (size_t Idx = 0; Idx != Job.F->Callees.size(); ++Idx)
+        NeedStub(Job.F->Callees[Idx], Job.CalleeNames[Idx]);
+
+    if (!AddModuleToJIT())
+        return;
+    SymbolMap StubSymbols;
+    for (const auto &Stub : NewStubs) {
+        JITTargetAddress Trampoline = LookupInJIT(Stub.first + ".interp");
+        if (!Trampoline)
+            return;
+        if (Error Err = TheStubs->createStub(Stub.first, Trampoline, JITSymbolFlags::Exported)) {
+            logAllUnhandledErrors(std::move(Err), errs(), "Error, ");
+            return;
+        }
+        StubSymbols[TheJIT->mangleAndIntern(Stub.first)] = TheStubs->findStub(Stub.first, false);
+    }
+    if (!StubSymbols.empty()) {
+        if (Error Err = TheJIT->getMainJITDylib().define(absoluteSymbols(std::move(StubSymbols)))) {
+            logAllUnhandledErrors(std::move(Err), errs(), "Error, ");
+            return;
+        }
+    }
+
+    EmitNativeFunction(Job);
+    OptimizeModule();
+    if (!AddModuleToJIT())
+        return;
+    JITTargetAddress Native = LookupInJIT(Job.Name + ".native");
+    JITTargetAddress Entry = LookupInJIT(Job.Name + ".tier");
+    if (!Native || !Entry)
+        return;
+
+    // Both switches are single pointer-sized stores, so every call sees either
+    // the old code or the new.
+    if (Error Err = TheStubs->updatePointer(Job.Name, Native)) {
+        logAllUnhandledErrors(std::move(Err), errs(), "Error, ");
+        return;
+    }
+    Job.F->Native.store((double (*)(const double *))(intptr_t)Entry, std::memory_order_release);
+    fprintf(stderr, "Compiled %s to native code in %.3f ms\n", Job.Name.c_str(),
+            MillisecondsSince(Start));
+}
+
+/// RequestTierUp - Queue a hot function for compilation.  Runs on the main
+/// thread, from the interpreter.
+static void RequestTierUp(const BCFunction &F)
+{
+    if (!F.Tierable)
+        return;
+    if (!TierPool)
+        TierPool = std::make_unique<ThreadPool>(hardware_concurrency(1));
+
+    TierJob Job{&F, Symbols.getName(F.Name).str(), {}, {}};
+    for (const BCFunction *Callee : F.Callees)
+        Job.CalleeNames.push_back(Symbols.getName(Callee->Name).str());
+    for (const HostFunction &Host : F.Hosts)
+        Job.HostNames.push_back(Symbols.getName(Host.Name).str());
+    TierPool->async([Job] { TierUp(Job); });
+}
+
+/*--------------------------------------------------------------------------------
+ * Top-Level parsing
+ *------------------------------------------------------------------------------*/
+
+// Only main uses what follows.  bench/kaleidoscope_bench.cpp includes this file
+// for its lexer, parser and code generator and brings its own main, so it
+// defines KALEIDOSCOPE_NO_MAIN to leave all of it out.
+#ifndef KALEIDOSCOPE_NO_MAIN
+
+/// ResidentBytes - The resident set size of the process: what it costs the
+/// machine, as opposed to what it has allocated.
+static uint64_t ResidentBytes()
+{
+    // The second field of statm is the number of resident pages.
+    uint64_t Pages = 0;
+    if (FILE *F = fopen("/proc/self/statm", "r")) {
+        unsigned long long Size, Resident;
+        if (fscanf(F, "%llu %llu", &Size, &Resident) == 2)
+            Pages = Resident;
+        fclose(F);
+    }
+    return Pages * sysconf(_SC_PAGESIZE);
+}
+
+/// PeakResidentBytes - The largest the resident set has been.
+static uint64_t PeakResidentBytes()
+{
+    struct rusage Usage;
+    if (getrusage(RUSAGE_SELF, &Usage) != 0)
+        return 0;
+#if defined(__APPLE__)
+    return Usage.ru_maxrss;
+#else
+    return (uint64_t)Usage.ru_maxrss * 1024;
+#endif
+}
+
+/// ReportRequested - Set by SIGUSR1; the driver writes the report, and clears
+/// this, between items.
+static volatile sig_atomic_t ReportRequested = 0;
+
+static void RequestReport(int)
+{
+    ReportRequested = 1;
+}
+
+/// PrintReport - Write everything measured so far as one JSON object.
+static void PrintReport(raw_ostream &OS)
+{
+    json::OStream J(OS, 2);
+    J.object([&] {
+        if (TimingPhases) {
+            J.attributeObject("time", [&] {
+                for (unsigned P = PH_Lex; P != NumPhases; ++P)
+                    J.attribute(PhaseNames[P], PhaseNanos[P].load() * 1e-9);
+            });
+
+            std::lock_guard<std::mutex> Lock(PassTimingLock);
+            std::vector<StringRef> Names;
+            for (auto &Entry : PassTimings)
+                Names.push_back(Entry.getKey());
+            std::sort(Names.begin(), Names.end());
+            J.attributeObject("passes", [&] {
+                for (StringRef Name : Names) {
+                    const PassTiming &T = PassTimings[Name];
+                    J.attributeObject(Name, [&] {
+                        J.attribute("time", T.Nanos * 1e-9);
+                        J.attribute("runs", (int64_t)T.Runs);
+                    });
+                }
+            });
+        }
+        if (CountingStats) {
+            J.attributeObject("counters", [&] {
+                for (unsigned C = 0; C != NumCounters; ++C)
+                    J.attribute(CounterNames[C], (int64_t)Counters[C].load());
+            });
+            J.attributeObject("memory", [&] {
+                J.attribute("resident_bytes", (int64_t)ResidentBytes());
+                J.attribute("peak_resident_bytes", (int64_t)PeakResidentBytes());
+            });
+        }
+    });
+    OS << "\n";
+}
+
+/// ReportInstrumentation - Write the report, if there is one to write.
+static void ReportInstrumentation()
+{
+    ReportRequested = 0;
+    if (TimingPhases || CountingStats)
+        PrintReport(*CreateInfoOutputFile());
+}
+
+/// FinishTiering - Drop the jobs that have not started and wait for the rest.
+static void FinishTiering()
+{
+    if (!TierPool)
+        return;
+    TierShutdown = true;
+    TierPool->wait();
+}
+
+std::unique_ptr<BCFunction> Interpreter::compile(FunctionAST &Fn)
+{
+    PrototypeAST &Proto = Fn.getProto();
+    auto F = std::make_unique<BCFunction>();
+    F->Name = Proto.getName();
+    BCCompiler Compiler(*F, Proto.getArgs(), Fn.getAssigned());
+    if (!Compiler.compileBody(Fn.getBody()))
+        return nullptr;
+    return F;
+}
+
+const BCFunction *Interpreter::define(FunctionAST &Fn)
+{
+    if (Functions.count(Fn.getProto().getName())) {
+        LogError("Function cannot be redefined.");
+        return nullptr;
+    }
+    std::unique_ptr<BCFunction> F = compile(Fn);
+    if (!F)
+        return nullptr;
+    F->Tierable = true;
+    auto &Slot = Functions[F->Name];
+    Slot = std::move(F);
+    return Slot.get();
+}
+
+/// startCacheKey - Seed H with everything besides the tokens that the object
+/// code of a definition depends on.
+static void startCacheKey(MD5 &H)
+{
+    H.update("kaleidoscope-cache-v3");
+    H.update(llvm::makeArrayRef((const uint8_t *)&OptLevel.getValue(), 1));
+    H.update(TheJTMB->getTargetTriple().str());
+    H.update(TheJTMB->getCPU());
+    H.update(TheJTMB->getFeatures().getString());
+    H.update(BatchWrappers ? "batch-wrappers" : "");
+    H.update(LibmIntrinsics ? "libm-intrinsics" : "");
+}
+
+/// CacheKeyFor - Finish H into the key a definition is cached under.
+static std::string CacheKeyFor(MD5 &H)
+{
+    MD5::MD5Result Result;
+    H.final(Result);
+    return CompileCache::KeyPrefix + Result.digest().str().str();
+}
+
+/// BindCacheKey - The key a definition whose tokens are keyed under TokenKey,
+/// and which makes Calls, is cached under once those calls are bound.  Its
+/// tokens do not say what a call compiles to: one naming a libm extern becomes
+/// an intrinsic, one naming any other extern calls into the host, and one
+/// naming a definition calls that.  Only the main thread knows which, since
+/// -pipeline and -parse-threads key definitions before the items ahead of them
+/// have been handled.
+static std::string BindCacheKey(StringRef TokenKey,
+                                ArrayRef<std::pair<SymbolID, unsigned>> Calls,
+                                PrototypeAST &Proto)
+{
+    enum CallBinding : uint8_t { CB_Definition, CB_Host, CB_Intrinsic };
+    MD5 H;
+    H.update(TokenKey);
+    for (const auto &Call : Calls) {
+        PrototypeAST *Callee = Call.first == Proto.getName()
+                               ? &Proto
+                               : FunctionProtos.lookup(Call.first);
+        uint8_t Binding = CB_Definition;
+        if (Callee && Callee->isExtern())
+            Binding = HostIntrinsic(Call.first, Call.second) ? CB_Intrinsic : CB_Host;
+        H.update(Binding);
+    }
+    return CacheKeyFor(H);
+}
+
+/// CallsMatchPrototypes - Whether every one of Calls, made by the definition of
+/// Proto, names a known function with the right number of arguments.  Codegen
+/// checks this; a definition loaded from the cache must be checked here.
+static bool CallsMatchPrototypes(ArrayRef<std::pair<SymbolID, unsigned>> Calls,
+                                 PrototypeAST &Proto)
+{
+    for (const auto &Call : Calls) {
+        PrototypeAST *Callee = Call.first == Proto.getName()
+                               ? &Proto : FunctionProtos.lookup(Call.first);
+        if (!Callee || Callee->getArgs().size() != Call.second)
+            return false;
+    }
+    return true;
+}
+
+/// CompileJob - A definition or top-level expression waiting to be compiled
+/// by RunParallelBatch, and the result of compiling it.
+struct CompileJob
+{
+    FunctionAST *Fn;
+    std::string ExprName;   // Set for a top-level expression
+    std::string IR;         // The printed IR of a definition
+    std::unique_ptr<MemoryBuffer> Obj;
+};
+
+/// BatchJobs - With -j, everything parsed from the current input so far.  Their
+/// ASTs stay in ItemArena until the input has been compiled.
+static std::vector<CompileJob> BatchJobs;
+
+/// ReleaseItemAST - Free the AST of the item just handled, unless -j is keeping
+/// ASTs alive until the whole input has been compiled.
+static void ReleaseItemAST()
+{
+    if (BatchJobs.empty())
+        ItemArena.reset();
+}
+
+/// Definition - What the REPL keeps of a definition it has handed to the JIT,
+/// so that it can be replaced: the tracker owning its code, an image to add it
+/// again from, and the other functions it calls.
+struct Definition
+{
+    ResourceTrackerSP RT;
+    std::unique_ptr<MemoryBuffer> Image;    // Bitcode, or an object file; null for
+                                            // IR that calls no other function
+    bool IsObject = false;
+    bool Compiled = false;                  // Looked up since it was last added
+    SmallVector<SymbolID, 4> Callees;
+};
+
+/// Definitions - Every definition the REPL has handed to the JIT, and Callers,
+/// the call graph between them, from callee to callers.
+static DenseMap<SymbolID, Definition> Definitions;
+static DenseMap<SymbolID, SmallSetVector<SymbolID, 4>> Callers;
+
+/// ReleaseDefinitions - Take the code of every definition out of the JIT.  A
+/// tracker destroyed while it still owns code hands it to the default tracker,
+/// which walks every symbol not yet compiled, so the trackers are emptied first
+/// to keep shutdown linear in the number of definitions.
+static void ReleaseDefinitions()
+{
+    for (auto &KV : Definitions)
+        consumeError(KV.second.RT->remove());
+    Definitions.clear();
+    Callers.clear();
+}
+
+/// CanRedefine - Whether Proto may replace the definition of its function:
+/// everything that calls it was compiled to pass the old number of arguments.
+/// Removing a tracker does not take the lazy call-through stubs made for its
+/// functions with it, so -lazy cannot redefine anything.
+static bool CanRedefine(PrototypeAST &Proto)
+{
+    SymbolID Name = Proto.getName();
+    if (LazyCompile && Definitions.count(Name)) {
+        fprintf(stderr, "Error, -lazy cannot redefine '%s'\n",
+                Symbols.getName(Name).str().c_str());
+        return false;
+    }
+    PrototypeAST *Old = FunctionProtos.lookup(Name);
+    auto It = Callers.find(Name);
+    if (!Old || Old->getArgs().size() == Proto.getArgs().size() || It == Callers.end() ||
+        It->second.empty())
+        return true;
+    fprintf(stderr, "Error, cannot change the number of arguments of '%s', which '%s' "
+                    "calls\n", Symbols.getName(Name).str().c_str(),
+            Symbols.getName(It->second.front()).str().c_str());
+    return false;
+}
+
+/// AddDefinitionImage - Hand D's image to the JIT under a new tracker.
+static bool AddDefinitionImage(Definition &D)
+{
+    D.RT = TheJIT->getMainJITDylib().createResourceTracker();
+    D.Compiled = false;
+    if (D.IsObject) {
+        if (Error Err = TheJIT->addObjectFile(
+                    D.RT, MemoryBuffer::getMemBufferCopy(D.Image->getBuffer(),
+                                                         D.Image->getBufferIdentifier()))) {
+            logAllUnhandledErrors(std::move(Err), errs(), "Error, ");
+            return false;
+        }
+        return true;
+    }
+
+    auto Ctx = std::make_unique<LLVMContext>();
+    auto M = parseBitcodeFile(D.Image->getMemBufferRef(), *Ctx);
+    if (!M) {
+        logAllUnhandledErrors(M.takeError(), errs(), "Error, ");
+        return false;
+    }
+    return AddIRToJIT(ThreadSafeModule(std::move(*M), std::move(Ctx)), D.RT,
+                      /*Lazily=*/true);
+}
+
+/// AddDefinition - Hand the JIT the definition of Name, which makes Calls: the
+/// current module, or Obj if it came from the cache.  This replaces any earlier
+/// definition of Name.  Each definition is a module of its own and calls the
+/// others by name, so the old code is only referenced by code linked against
+/// it: whatever calls Name, directly or not.  Just those are added again from
+/// their images, to be linked afresh, without being generated or optimised.
+static bool AddDefinition(SymbolID Name, ArrayRef<std::pair<SymbolID, unsigned>> Calls,
+                          std::unique_ptr<MemoryBuffer> Obj)
+{
+    SmallSetVector<SymbolID, 8> Stale;
+    auto Old = Definitions.find(Name);
+    if (Old != Definitions.end()) {
+        Stale.insert(Name);
+        for (size_t Idx = 0; Idx != Stale.size(); ++Idx) {
+            auto It = Callers.find(Stale[Idx]);
+            if (It != Callers.end())
+                Stale.insert(It->second.begin(), It->second.end());
+        }
+        for (SymbolID Callee : Old->second.Callees)
+            Callers[Callee].remove(Name);
+        for (SymbolID S : Stale)
+            ExitOnErr(Definitions[S].RT->remove());
+    }
+
+    Definition &D = Definitions[Name];
+    D.Callees.clear();
+    D.Compiled = false;
+    for (const auto &Call : Calls) {
+        if (Call.first != Name && Callers[Call.first].insert(Name))
+            D.Callees.push_back(Call.first);
+    }
+    D.IsObject = Obj != nullptr;
+    bool Added;
+    if (Obj) {
+        D.Image = std::move(Obj);
+        Added = AddDefinitionImage(D);
+    } else {
+        // Only callers are ever added again.
+        D.Image.reset();
+        if (!D.Callees.empty()) {
+            SmallVector<char, 0> Bitcode;
+            raw_svector_ostream OS(Bitcode);
+            WriteBitcodeToFile(*TheModule, OS);
+            D.Image = std::make_unique<SmallVectorMemoryBuffer>(
+                    std::move(Bitcode), TheModule->getModuleIdentifier(),
+                    /*RequiresNullTerminator=*/false);
+        }
+        D.RT = TheJIT->getMainJITDylib().createResourceTracker();
+        Added = AddModuleToJIT(D.RT, /*Lazily=*/true);
+    }
+
+    for (SymbolID S : Stale) {
+        if (S != Name)
+            AddDefinitionImage(Definitions[S]);
+    }
+    if (Stale.size() > 1)
+        fprintf(stderr, "Relinked %zu callers of %s\n", Stale.size() - 1,
+                Symbols.getName(Name).str().c_str());
+    return Added;
+}
+
+/// ParseKeyedDefinition - Parse a definition and, if it will be compiled in a
+/// module of its own with -cache-dir, set Key to the key it is cached under.
+static FunctionAST *ParseKeyedDefinition(Parser &P, std::string &Key)
+{
+    // Definitions compiled one module each can be cached by their tokens.
+    MD5 TokenHash;
+    bool UseCache = TheCache && !BatchMode;
+    if (UseCache) {
+        startCacheKey(TokenHash);
+        P.setTokenHash(&TokenHash);
+    }
+    FunctionAST *FnAST = P.ParseDefinition();
+    P.setTokenHash(nullptr);
+    Key = UseCache && FnAST ? CacheKeyFor(TokenHash) : "";
+    return FnAST;
+}
+
+/// DefineFunction - Hand a definition, which makes Calls and whose tokens are
+/// keyed under Key if that is set, to the JIT, or add it to the batch module.
+static void DefineFunction(FunctionAST &FnAST, ArrayRef<std::pair<SymbolID, unsigned>> Calls,
+                           const std::string &Key)
+{
+    if (!BatchMode && !CanRedefine(FnAST.getProto()))
+        return;
+    std::string BoundKey = Key.empty() ? "" : BindCacheKey(Key, Calls, FnAST.getProto());
+    std::unique_ptr<MemoryBuffer> Obj;
+    if (!BoundKey.empty() && CallsMatchPrototypes(Calls, FnAST.getProto()))
+        Obj = TheCache->lookup(BoundKey);
+
+    if (Obj) {
+        // A cache hit: skip codegen and optimisation altogether.
+        PrototypeAST &Proto = RememberPrototype(FnAST.getProto());
+        if (AddDefinition(Proto.getName(), Calls, std::move(Obj)))
+            fprintf(stderr, "Read function definition: %s (cached)\n",
+                    Symbols.getName(Proto.getName()).str().c_str());
+    } else if (auto *FnIR = FnAST.codegen()) {
+        fprintf(stderr, "Read function definition:");
+        FnIR->print(errs());
+        fprintf(stderr, "\n");
+        if (BatchWrappers)
+            EmitBatchWrapper(FnIR);
+        if (!BatchMode) {
+            // The wrapper only vectorises once the definition is inlined into it.
+            if (BatchWrappers)
+                OptimizeModule();
+            if (!BoundKey.empty())
+                TheModule->setModuleIdentifier(BoundKey);
+            AddDefinition(FnAST.getProto().getName(), Calls, nullptr);
+        }
+    }
+}
+
+static void HandleDefinition(Parser &P)
+{
+    if (UseInterpreter) {
+        if (auto FnAST = P.ParseDefinition()) {
+            if (auto *F = TheInterpreter.define(*FnAST))
+                fprintf(stderr, "Read function definition: %s (%zu instructions)\n",
+                        Symbols.getName(F->Name).str().c_str(), F->Code.size());
+        } else {
+            // Skip token for error recovery.
+            P.getNextToken();
+        }
+        ReleaseItemAST();
+        return;
+    }
+
+    if (NumThreads > 1) {
+        if (auto FnAST = P.ParseDefinition()) {
+            // Record the prototype now, so every job can declare every function.
+            RememberPrototype(FnAST->getProto());
+            BatchJobs.push_back({FnAST, "", "", nullptr});
+        } else {
+            // Skip token for error recovery.
+            P.getNextToken();
+        }
+        ReleaseItemAST();
+        return;
+    }
+
+    std::string Key;
+    if (FunctionAST *FnAST = ParseKeyedDefinition(P, Key)) {
+        DefineFunction(*FnAST, P.getCalls(), Key);
+    } else {
+        // Skip token for error recovery.
+        P.getNextToken();
+    }
+    ReleaseItemAST();
+}
+
+/// DeclareExtern - Declare a function that the host process defines.
+static void DeclareExtern(PrototypeAST &ProtoAST)
+{
+    if (auto *FnIR = ProtoAST.codegen()) {
+        fprintf(stderr, "Read extern: ");
+        FnIR->print(errs());
+        fprintf(stderr, "\n");
+        RememberPrototype(ProtoAST);
+    }
+}
+
+static void HandleExtern(Parser &P)
+{
+    if (UseInterpreter) {
+        if (auto ProtoAST = P.ParseExtern()) {
+            TheInterpreter.addExtern(*ProtoAST);
+            fprintf(stderr, "Read extern: %s\n",
+                    Symbols.getName(ProtoAST->getName()).str().c_str());
+        } else {
+            // Skip for error recovery.
+            P.getNextToken();
+        }
+        ReleaseItemAST();
+        return;
+    }
+
+    if (auto ProtoAST = P.ParseExtern()) {
+        DeclareExtern(*ProtoAST);
+    } else {
+        // Skip for error recovery.
+        P.getNextToken();
+    }
+    ReleaseItemAST();
+}
 
-static std::string identifierString; // Filled in if tok_identifier
-static double NumVal;                // Filled in if tok_number
+/// BatchExprs - In batch mode, the anonymous functions of the current input's
+/// top-level expressions, in the order they appeared.
+static std::vector<std::string> BatchExprs;
 
-/// gettok - Return the next token from standard input.
-static int gettok()
+/// EvaluateTopLevelExpr - Compile and run a top-level expression or, in batch
+/// mode, add it to the module, to be run once the whole input is compiled.
+static void EvaluateTopLevelExpr(FunctionAST &FnAST)
 {
-    static int last_char = ' ';
-    // Skips any whitespace
-    while (isspace(last_char)) // identifier: [a-zA-Z][a-zA-Z0-9]*
-        last_char = getchar();
+    // In batch mode, keep the expression in the module under a name of its own
+    // and run it once the whole input has been compiled.
+    if (BatchMode) {
+        if (auto *FnIR = FnAST.codegen()) {
+            BatchExprs.push_back("__anon_expr." + std::to_string(BatchExprs.size()));
+            FnIR->setName(BatchExprs.back());
+        }
+        return;
+    }
 
-    if (isalpha(last_char)) {
-        identifierString = last_char;
-        while (isalnum((last_char = getchar())))
-            identifierString += last_char;
+    // Evaluate a top-level expression into an anonymous function.
+    auto CompileStart = std::chrono::steady_clock::now();
+    if (!FnAST.codegen())
+        return;
 
-        if (identifierString == "def")
-            return tok_def;
-        if (identifierString == "extern")
-            return tok_extern;
+    // Create a ResourceTracker to track JIT'd memory allocated to our anonymous
+    // expression -- that way we can free it after executing.
+    auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+    if (AddModuleToJIT(RT)) {
+        // Search the JIT for the __anon_expr symbol; looking it up is what
+        // compiles it.
+        auto ExprSymbol = LookupSymbol("__anon_expr");
+        if (!ExprSymbol) {
+            logAllUnhandledErrors(ExprSymbol.takeError(), errs(), "Error, ");
+        } else {
+            double CompileMs = MillisecondsSince(CompileStart);
 
-        return tok_identifier;
+            // Get the symbol's address and cast it to the right type (takes no
+            // arguments, returns a double) so we can call it as a native function.
+            auto *FP = (double (*)())(intptr_t)ExprSymbol->getAddress();
+            auto RunStart = std::chrono::steady_clock::now();
+            double Result = FP();
+            double RunMs = MillisecondsSince(RunStart);
+            fprintf(stderr, "Evaluated to %f (compile %.3f ms, run %.3f ms)\n",
+                    Result, CompileMs, RunMs);
+        }
     }
 
-    if (isdigit(last_char) || last_char == '.') {  // Number: [0-9.]+
-        std::string num_str;
-        do {
-            num_str += last_char;
-            last_char = getchar();
-        } while (isdigit(last_char) || last_char == '.');
-        NumVal = std::strtod(num_str.c_str(), 0);
-        return tok_number;
+    // Delete the anonymous expression module from the JIT.
+    ExitOnErr(RT->remove());
+}
+
+static void HandleTopLevelExpression(Parser &P)
+{
+    if (UseInterpreter) {
+        if (auto FnAST = P.ParseTopLevelExpr()) {
+            auto CompileStart = std::chrono::steady_clock::now();
+            if (auto F = Interpreter::compile(*FnAST)) {
+                double CompileMs = MillisecondsSince(CompileStart);
+                auto RunStart = std::chrono::steady_clock::now();
+                double Result = Interpreter::run(*F, nullptr);
+                double RunMs = MillisecondsSince(RunStart);
+                fprintf(stderr, "Evaluated to %f (compile %.3f ms, run %.3f ms)\n",
+                        Result, CompileMs, RunMs);
+            }
+        } else {
+            // Skip for error recovery
+            P.getNextToken();
+        }
+        ReleaseItemAST();
+        return;
     }
 
-    if (last_char == '#') {
-        // Comment until end of line.
-        do
-            last_char = getchar();
-        while (last_char != EOF && last_char != '\n' && last_char != '\r');
+    if (NumThreads > 1) {
+        if (auto FnAST = P.ParseTopLevelExpr()) {
+            RememberPrototype(FnAST->getProto());
+            std::string Name = "__anon_expr." + std::to_string(BatchExprs.size());
+            BatchExprs.push_back(Name);
+            BatchJobs.push_back({FnAST, Name, "", nullptr});
+        } else {
+            // Skip for error recovery
+            P.getNextToken();
+        }
+        ReleaseItemAST();
+        return;
+    }
 
-        if (last_char != EOF)
-            return gettok();
+    if (auto FnAST = P.ParseTopLevelExpr()) {
+        EvaluateTopLevelExpr(*FnAST);
+    } else {
+        // Skip for error recovery
+        P.getNextToken();
     }
-    // Check for end of file.  Don't eat the EOF.
-    if (last_char == EOF)
-        return tok_eof;
-    
-    // Otherwise, just return the character as its ascii value.
-    int this_char = last_char;
-    last_char = getchar();
-    return this_char;
+    ReleaseItemAST();
 }
-/*-------------------------------------------------------------------------------
- * AST -- Abstract Syntax Tree (Parse Tree)
- *------------------------------------------------------------------------------*/
-namespace
+
+/// RunBatch - Optimise and compile the module holding everything read from the
+/// current input, then evaluate its top-level expressions in order.
+static void RunBatch()
 {
-/// ExprAST - Base class for all expression nodes.
-    class ExprAST 
-    {
-    public:
-        virtual ~ExprAST() = default;
-        virtual Value *codegen() = 0;
-    };
+    auto CompileStart = std::chrono::steady_clock::now();
+    if (!LazyCompile)
+        OptimizeModule();
+    if (!AddModuleToJIT(nullptr, /*Lazily=*/true)) {
+        BatchExprs.clear();
+        return;
+    }
 
-/// NumberExprAST - Expression class for numeric literals like "1.0".
-    class NumberExprAST : public ExprAST 
-    {
-        double Val;
-    public:
-        NumberExprAST(double val) : Val(val) {}
-        Value *codegen() override;
-    };
+    // Looking up the first symbol compiles the whole module; with -lazy, each
+    // lookup compiles just that expression, and the rest waits to be called.
+    std::vector<double (*)()> Exprs;
+    for (const std::string &Name : BatchExprs) {
+        auto ExprSymbol = LookupSymbol(Name);
+        if (!ExprSymbol) {
+            logAllUnhandledErrors(ExprSymbol.takeError(), errs(), "Error, ");
+            BatchExprs.clear();
+            return;
+        }
+        Exprs.push_back((double (*)())(intptr_t)ExprSymbol->getAddress());
+    }
+    fprintf(stderr, "Compiled in %.3f ms\n", MillisecondsSince(CompileStart));
 
-/// VariableExprAST - Expression class for referencing a variable, like "a".
-    class VariableExprAST : public ExprAST 
-    {
-        std::string Name;
-    public:
-        VariableExprAST(const std::string &name) : Name(name) {}
-    };
+    for (auto *FP : Exprs) {
+        auto RunStart = std::chrono::steady_clock::now();
+        double Result = FP();
+        double RunMs = MillisecondsSince(RunStart);
+        fprintf(stderr, "Evaluated to %f (run %.3f ms)\n", Result, RunMs);
+    }
+    BatchExprs.clear();
+}
 
-/// BinaryExprAST - Expression class for a binary operator.
-    class BinaryExprAST : public ExprAST 
-    {
-        char Op;
-        std::unique_ptr<ExprAST> LHS, RHS;
-    public:
-        BinaryExprAST(char Op, std::unique_ptr<ExprAST> LHS,
-                      std::unique_ptr<ExprAST> RHS)
-                : Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
-    };
+/// CompileFunction - Lower, optimise and compile one job to an object file,
+/// in a context and module of its own.  Runs on a pool thread.
+static void CompileFunction(CompileJob &Job)
+{
+    InitializeModule();
+    Function *F = Job.Fn->codegen();
+    if (!F)
+        return;
 
-/// CallExprAST - Expression class for function calls.
-    class CallExprAST : public ExprAST 
-    {
-        std::string Callee;
-        std::vector<std::unique_ptr<ExprAST>> Args;
-    public:
-        CallExprAST(const std::string &Callee,
-                    std::vector<std::unique_ptr<ExprAST>> Args)
-                : Callee(Callee), Args(std::move(Args)) {}
-    };
+    if (!Job.ExprName.empty()) {
+        F->setName(Job.ExprName);
+    } else {
+        raw_string_ostream OS(Job.IR);
+        F->print(OS);
+        if (BatchWrappers) {
+            EmitBatchWrapper(F);
+            OptimizeModule();
+        }
+    }
 
-/// PrototypeAST - This class represents the "prototype" for a function,
-/// which captures its name, and its argument names (thus implicitly the number
-/// of arguments the function takes).
-    class PrototypeAST 
+    PhaseRegion Region(PH_Materialize);
+    auto Obj = SimpleCompiler(*TheTM)(*TheModule);
+    if (!Obj) {
+        logAllUnhandledErrors(Obj.takeError(), errs(), "Error, ");
+        return;
+    }
+    Job.Obj = std::move(*Obj);
+}
+
+/// RunParallelBatch - Compile every job of the current input across a thread
+/// pool, link the objects into the JIT, and evaluate the top-level expressions
+/// in order.
+static void RunParallelBatch()
+{
+    auto CompileStart = std::chrono::steady_clock::now();
     {
-        std::string Name;
-        std::vector<std::string> Args;
-    public:
-        PrototypeAST(const std::string &Name, std::vector<std::string> Args)
-                : Name(Name), Args(std::move(Args)) {}
+        ThreadPool Pool(hardware_concurrency(NumThreads));
+        for (CompileJob &Job : BatchJobs)
+            Pool.async([&Job] { CompileFunction(Job); });
+        Pool.wait();
+    }
 
-        const std::string &getName() { return Name; }
-    };
+    bool Failed = false;
+    for (CompileJob &Job : BatchJobs) {
+        if (!Job.IR.empty())
+            fprintf(stderr, "Read function definition:%s\n", Job.IR.c_str());
+        if (!Job.Obj) {
+            Failed |= !Job.ExprName.empty();
+            continue;
+        }
+        if (Error Err = TheJIT->addObjectFile(std::move(Job.Obj))) {
+            logAllUnhandledErrors(std::move(Err), errs(), "Error, ");
+            Failed = true;
+        }
+    }
+    BatchJobs.clear();
+    ItemArena.reset();
 
-/// FunctionAST - This class represents a function definition itself.
-    class FunctionAST 
-    {
-        std::unique_ptr<PrototypeAST> Proto;
-        std::unique_ptr<ExprAST> Body;
+    // Look every expression up at once, so the objects are linked in one go.
+    SymbolLookupSet Names;
+    for (const std::string &Name : BatchExprs)
+        Names.add(TheJIT->mangleAndIntern(Name));
+    Expected<SymbolMap> Syms = SymbolMap();
+    if (!Failed) {
+        PhaseRegion Region(PH_Materialize);
+        Syms = TheJIT->getExecutionSession().lookup(
+                {{&TheJIT->getMainJITDylib(), JITDylibLookupFlags::MatchAllSymbols}},
+                std::move(Names));
+    }
+    if (!Syms) {
+        logAllUnhandledErrors(Syms.takeError(), errs(), "Error, ");
+        Failed = true;
+    }
+    if (Failed) {
+        fprintf(stderr, "Error, not running the top-level expressions\n");
+        BatchExprs.clear();
+        return;
+    }
+    fprintf(stderr, "Compiled on %u threads in %.3f ms\n", (unsigned)NumThreads,
+            MillisecondsSince(CompileStart));
+
+    for (const std::string &Name : BatchExprs) {
+        auto *FP = (double (*)())(intptr_t)(*Syms)[TheJIT->mangleAndIntern(Name)]
+                .getAddress();
+        auto RunStart = std::chrono::steady_clock::now();
+        double Result = FP();
+        double RunMs = MillisecondsSince(RunStart);
+        fprintf(stderr, "Evaluated to %f (run %.3f ms)\n", Result, RunMs);
+    }
+    BatchExprs.clear();
+}
 
-    public:
-        FunctionAST(std::unique_ptr<PrototypeAST> Proto,
-                      std::unique_ptr<ExprAST> Body)
-                : Proto(std::move(Proto)), Body(std::move(Body)) {}
-    };
-} // end anonymous namespace
 /*--------------------------------------------------------------------------------
- * Parser
+ * Ahead-of-time compilation
  *------------------------------------------------------------------------------*/
-/// CurTok/getNextToken - Provide a simple token buffer.  CurTok is the current
-/// token the parser is looking at.  getNextToken reads another token from the
-/// lexer and updates CurTok with its results.
-static int CurTok;
+static cl::opt<std::string> OutputFilename("o",
+        cl::desc("Compile every input into one module and write it to this file "
+                 "instead of running it: a shared library if the name ends in "
+                 "'.so', an object file otherwise"),
+        cl::value_desc("filename"));
 
-static int getNextToken() 
+/// EmitObjectFile - Optimise the current module and write it to Path as a
+/// position-independent object file for the host.
+static bool EmitObjectFile(StringRef Path)
 {
-    return CurTok = gettok();
-}
+    JITTargetMachineBuilder JTMB = *TheJTMB;
+    JTMB.setRelocationModel(Reloc::PIC_);
+    auto TM = JTMB.createTargetMachine();
+    if (!TM) {
+        logAllUnhandledErrors(TM.takeError(), errs(), "Error, ");
+        return false;
+    }
+    TheModule->setTargetTriple((*TM)->getTargetTriple().str());
+    TheModule->setDataLayout((*TM)->createDataLayout());
+    OptimizeModule();
 
-std::unique_ptr<ExprAST> LogError(const char *Str)
-{
-    fprintf(stderr, "Error, %s\n", Str);
-    return nullptr;
+    std::error_code EC;
+    raw_fd_ostream Dest(Path, EC, sys::fs::OF_None);
+    if (EC) {
+        fprintf(stderr, "Error, cannot open '%s': %s\n", Path.str().c_str(),
+                EC.message().c_str());
+        return false;
+    }
+
+    legacy::PassManager CodeGenPasses;
+    if ((*TM)->addPassesToEmitFile(CodeGenPasses, Dest, nullptr, CGFT_ObjectFile)) {
+        fprintf(stderr, "Error, the host target cannot emit object files\n");
+        return false;
+    }
+    {
+        PhaseRegion Region(PH_Materialize);
+        CodeGenPasses.run(*TheModule);
+    }
+    Dest.close();
+    if (Dest.has_error()) {
+        fprintf(stderr, "Error, cannot write '%s': %s\n", Path.str().c_str(),
+                Dest.error().message().c_str());
+        Dest.clear_error();
+        return false;
+    }
+    return true;
 }
 
-std::unique_ptr<PrototypeAST> LogErrorP(const char *Str) 
+/// LinkSharedLibrary - Link the object file ObjPath into the shared library
+/// Path with the system C compiler driver.
+static bool LinkSharedLibrary(StringRef ObjPath, StringRef Path)
 {
-    LogError(Str);
-    return nullptr;
-}
+    auto CC = sys::findProgramByName("cc");
+    if (!CC) {
+        fprintf(stderr, "Error, cannot find 'cc' to link '%s'\n", Path.str().c_str());
+        return false;
+    }
 
-static std:: unique_ptr<ExprAST> ParseExpression();
+    StringRef Args[] = {*CC, "-shared", "-o", Path, ObjPath, "-lm"};
+    std::string ErrMsg;
+    if (sys::ExecuteAndWait(*CC, Args, None, {}, 0, 0, &ErrMsg) != 0) {
+        fprintf(stderr, "Error, linking '%s' failed%s%s\n", Path.str().c_str(),
+                ErrMsg.empty() ? "" : ": ", ErrMsg.c_str());
+        return false;
+    }
+    return true;
+}
 
-/// numberexp ::= number
-static std::unique_ptr<ExprAST> ParseNumberExpr()
+/// EmitOutput - Write everything compiled from the inputs to OutputFilename.
+/// Definitions keep their names and top-level expressions are exported as
+/// __anon_expr.N, numbered in source order, so a host can dlsym them.
+static bool EmitOutput()
 {
-    auto Result = std::make_unique<NumberExprAST>(NumVal);
-    getNextToken();
-    return std::move(Result);
+    bool OK;
+    if (sys::path::extension(OutputFilename) != ".so") {
+        OK = EmitObjectFile(OutputFilename);
+    } else {
+        SmallString<128> ObjPath;
+        if (std::error_code EC = sys::fs::createTemporaryFile("kaleidoscope", "o", ObjPath)) {
+            fprintf(stderr, "Error, cannot create a temporary object file: %s\n",
+                    EC.message().c_str());
+            return false;
+        }
+        OK = EmitObjectFile(ObjPath) && LinkSharedLibrary(ObjPath, OutputFilename);
+        sys::fs::remove(ObjPath);
+    }
+
+    if (OK)
+        fprintf(stderr, "Wrote %s\n", OutputFilename.c_str());
+    return OK;
 }
 
+/*--------------------------------------------------------------------------------
+ * Memory budget
+ *------------------------------------------------------------------------------*/
+// A REPL session may run for days, so nothing is kept past its use: an item's
+// AST goes when its arena is reset, a top-level expression's code with its
+// tracker once it has run, and a definition's code with its tracker once it
+// is replaced.  What is left is the arenas' spare slabs, the IR of definitions
+// the JIT has not compiled yet and free heap pages, and -memory-budget gives
+// those back whenever the resident set grows past it.
 
-/// parenexpr ::= '(' expression ')'
-static std::unique_ptr<ExprAST> ParseParenExpr() 
-{
-    getNextToken();
-    auto V = ParseExpression();
-    if (!V)
-        return nullptr;
+static cl::opt<unsigned> MemoryBudget("memory-budget", cl::value_desc("MiB"),
+        cl::desc("Reclaim memory between items whenever the resident set grows past "
+                 "this many MiB (default: no budget)"));
 
-    if (CurTok != ')')
-        return LogError("expected ')");
-    getNextToken();
-    return V;
+/// CompileDefinitions - Have the JIT compile every definition it still holds
+/// as IR, which it frees once the object is emitted, rather than keeping it
+/// until the definition is first called.  With -lazy, looking a function up
+/// only makes its stub, so this does nothing.  A definition that fails to
+/// compile is reported when it is called, as it would have been anyway.
+static void CompileDefinitions()
+{
+    if (LazyCompile)
+        return;
+    // A few at a time: the JIT holds every object in a lookup until all of them
+    // are linked.
+    SymbolLookupSet Names;
+    auto Compile = [&] {
+        PhaseRegion Region(PH_Materialize);
+        consumeError(TheJIT->getExecutionSession()
+                             .lookup({{&TheJIT->getMainJITDylib(),
+                                       JITDylibLookupFlags::MatchAllSymbols}},
+                                     std::move(Names))
+                             .takeError());
+        Names = SymbolLookupSet();
+    };
+    for (auto &KV : Definitions) {
+        if (KV.second.Compiled)
+            continue;
+        KV.second.Compiled = true;
+        Names.add(TheJIT->mangleAndIntern(Symbols.getName(KV.first)));
+        if (Names.size() == 16)
+            Compile();
+    }
+    if (!Names.empty())
+        Compile();
 }
 
-/// identifierexpr
-///   ::= identifier
-///   ::= identifier '(' expression* ')'
-static std::unique_ptr<ExprAST> ParseIdentifierExpr() 
+/// EnforceMemoryBudget - Between items: if the resident set has outgrown
+/// -memory-budget, reclaim what can go without losing anything still callable.
+/// Idle, if set, is an arena holding no AST, whose spare slabs can go too.
+static void EnforceMemoryBudget(ASTArena *Idle)
 {
-    std::string IdName = identifierString;
-    getNextToken();    // eat identifier
-
-    if (CurTok != '(')     // Simple variable ref
-        return std::make_unique<VariableExprAST>(IdName);
+    // After reclaiming, wait for the resident set to grow by an eighth of the
+    // budget before trying again, so a session whose live code alone is over
+    // budget does not reclaim after every item.
+    static uint64_t Threshold = 0;
+    static bool Warned = false;
+    if (!MemoryBudget)
+        return;
+    uint64_t Budget = (uint64_t)MemoryBudget << 20;
+    if (ResidentBytes() <= std::max(Budget, Threshold))
+        return;
 
+    if (CountingStats)
+        AddToCounter(CT_Reclaims, 1);
+    if (Idle)
+        Idle->shrink();
+    CompileDefinitions();
+#if defined(__GLIBC__)
+    malloc_trim(0);
+#endif
 
-    // Call
-    getNextToken();    // eat (
-    std::vector<std::unique_ptr<ExprAST>> Args;
-    if (CurTok != ')') {
-        while (true) {
-            if (auto Arg = ParseExpression())
-                Args.push_back(std::move(Arg));
-            else
-                return nullptr;
-
-            if (CurTok == ')')
-                return LogError("Expected ')' or ',' in argument list");
-            getNextToken();
-        }
+    // What is still resident is in use; say so once rather than after every
+    // item.
+    uint64_t Resident = ResidentBytes();
+    Threshold = Resident + Budget / 8;
+    if (Resident > Budget && !Warned) {
+        fprintf(stderr, "Warning, %.1f MiB still resident after reclaiming memory, over "
+                        "the budget of %u MiB\n", Resident / 1048576.0, (unsigned)MemoryBudget);
+        Warned = true;
     }
-    // Eat the ')'.
-    getNextToken();
-    return std::make_unique<CallExprAST>(IdName, std::move(Args));
 }
 
-/// primary
-///   ::= identifierexpr
-///   ::= numberexpr
-///   ::= parenexpr
-static std::unique_ptr<ExprAST> ParsePrimary()
+/// top ::= definition | external | expression | ';'
+static void MainLoop(Parser &P)
 {
-    switch (CurTok) {
-        default:
-            return LogError("unknown token when expecting an expression");
-        case tok_identifier:
-            return ParseIdentifierExpr();
-        case tok_number:
-            return ParseNumberExpr();
-        case '(':
-            return ParseParenExpr();
+    while (true) {
+        if (ReportRequested)
+            ReportInstrumentation();
+        EnforceMemoryBudget(BatchJobs.empty() ? &ItemArena : nullptr);
+        fprintf(stderr, "ready> ");
+        switch (P.getCurTok()) {
+            case tok_eof:
+                return;
+            case ';':   // ignore top-level semicolons.
+                P.getNextToken();
+                break;
+            case tok_def:
+                HandleDefinition(P);
+                break;
+            case tok_extern:
+                HandleExtern(P);
+                break;
+            default:
+                HandleTopLevelExpression(P);
+                break;
+        }        
     }
 }
 
-/// BinopPrecedence - This holds the precedence for each binary operator that is
-/// defined.
-static std::map<char, int> BinopPrecedence;
+/*--------------------------------------------------------------------------------
+ * Pipelined input
+ *------------------------------------------------------------------------------*/
+static cl::opt<bool> Pipelined("pipeline",
+        cl::desc("Lex, parse and compile each input on threads of their own, "
+                 "connected by lock-free queues"));
 
-/// GetTokPrecedence - Get the precedence of the pending binary operator token.
-static int GetTokPrecedence()
+/// ParsedItem - A top-level item parsed on the parser thread, waiting to be
+/// handled on the main thread.  Each item has an arena of its own, so the parser
+/// can run ahead of the item being compiled; handled items go back to it to be
+/// reused.  The errors reported while parsing it are kept in Errors, for the
+/// main thread to print in turn.
+struct ParsedItem
 {
-    if (!isascii(CurTok))
-        return -1;
-
-    int TokPrec = BinopPrecedence[CurTok];
-    if (TokPrec <= 0) return -1;
-    return TokPrec;
-}
+    int Kind;               // tok_def, tok_extern, 0 for an expression, or -1 for
+                            // one that did not parse
+    FunctionAST *Fn;        // A definition or expression
+    PrototypeAST *Proto;    // An extern
+    std::vector<std::pair<SymbolID, unsigned>> Calls;
+    std::string CacheKey;
+    std::string Errors;
+    ASTArena Arena;
+};
 
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int, std::unique_ptr<ExprAST>);
-/// expression
-///   ::= primary binoprhs
-///
-static std::unique_ptr<ExprAST> ParseExpression() 
+/// Pipeline - The queues between the stages: tokens from the lexer thread to
+/// the parser thread, and items from there to the main thread, which passes
+/// them back once it is done with them.
+struct Pipeline
 {
-  auto LHS = ParsePrimary();
-  if (!LHS)
-    return nullptr;
+    TokenRing Tokens;
+    SPSCQueue<ParsedItem *, 64> Items;      // Null once the input is over
+    SPSCQueue<ParsedItem *, 64> FreeItems;
+};
 
-  return ParseBinOpRHS(0, std::move(LHS));
-}
-/// binoprhs
-///   ::= ('+' primary)*
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
-                                              std::unique_ptr<ExprAST> LHS) 
+/// LexInput - The lexer stage: push every token of SB, up to tok_eof.
+static void LexInput(SourceBuffer &SB, TokenRing &Tokens)
 {
-    // If this is a binop, find its precedence.
+    Lexer Lex(Symbols, SB);
     while (true) {
-        int TokPrec = GetTokPrecedence();
-        
-        // If this is a binop that binds at least as tightly as the current binop,
-        // consume it, otherwise we are done.
-        if (TokPrec < ExprPrec)
-            return LHS;
+        int Tok = Lex.gettok();
+        Tokens.push({Tok, Lex.getIdentifier(), Lex.getNumVal(), Lex.getTokRange()});
+        if (Tok == tok_eof)
+            return;
     }
 }
 
-static std::unique_ptr<PrototypeAST> ParsePrototype() 
+/// ParseInput - The parser stage: parse top-level items as MainLoop does, and
+/// pass them on in order, along with any that did not parse.
+static void ParseInput(Parser &P, Pipeline &Pipe)
 {
-    if (CurTok != tok_identifier)
-    return LogErrorP("Expected function name in prototype");
-
-    std::string FnName = identifierString;
-    getNextToken();
+    // Prime the first token.
+    P.getNextToken();
 
-    if (CurTok != '(')
-        return LogErrorP("Expected '(' in prototype");
-    
-    // Read the list of argument names.
-    std::vector<std::string> ArgNames;
-    while (getNextToken() == tok_identifier)
-        ArgNames.push_back(identifierString);
-    if (CurTok != ')')
-        return LogErrorP("Expected ')' in prototype");
-    
-    // success.
-    getNextToken();     // eat ')'.
+    while (true) {
+        int Tok = P.getCurTok();
+        if (Tok == tok_eof)
+            break;
+        if (Tok == ';') {   // ignore top-level semicolons.
+            P.getNextToken();
+            continue;
+        }
 
-    return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames));
+        ParsedItem *Item;
+        if (!Pipe.FreeItems.tryPop(Item))
+            Item = new ParsedItem();
+        Item->Arena.reset();
+        P.setArena(Item->Arena);
+        Item->Kind = Tok == tok_def || Tok == tok_extern ? Tok : 0;
+        Item->Fn = nullptr;
+        Item->Proto = nullptr;
+        Item->Errors.clear();
+        DeferredErrors = &Item->Errors;
+        switch (Item->Kind) {
+            case tok_def:
+                Item->Fn = ParseKeyedDefinition(P, Item->CacheKey);
+                break;
+            case tok_extern:
+                Item->Proto = P.ParseExtern();
+                break;
+            default:
+                Item->Fn = P.ParseTopLevelExpr();
+                break;
+        }
+        DeferredErrors = nullptr;
+        if (Item->Fn || Item->Proto) {
+            Item->Calls.assign(P.getCalls().begin(), P.getCalls().end());
+        } else {
+            // Skip token for error recovery.
+            Item->Kind = -1;
+            P.getNextToken();
+        }
+        Pipe.Items.push(Item);
+    }
+    Pipe.Items.push(nullptr);
 }
 
-/// definition ::= 'def' prototype expression
-static std::unique_ptr<FunctionAST> ParseDefinition()
+/// RunPipelined - Lex SB on one thread and parse it on another, while the main
+/// thread compiles and runs each item as soon as it has been parsed.  Only the
+/// lexer thread interns names; the others only look up the ones handed to them.
+static void RunPipelined(SourceBuffer &SB)
 {
-    getNextToken();     // eat def.
-    auto Proto = ParsePrototype();
-    if (!Proto) return nullptr;
+    Pipeline Pipe;
+    Lexer Replay(Symbols, Pipe.Tokens);
+    Parser P(Replay, ItemArena);
+    P.setHashConsing(HashCons);
+    P.setConstantFolding(FoldConstants);
 
-    if (auto E = ParseExpression())
-        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
-    return nullptr;
-}
+    std::thread LexThread(LexInput, std::ref(SB), std::ref(Pipe.Tokens));
+    std::thread ParseThread(ParseInput, std::ref(P), std::ref(Pipe));
+    while (ParsedItem *Item = Pipe.Items.pop()) {
+        fprintf(stderr, "ready> ");
+        fputs(Item->Errors.c_str(), stderr);
+        switch (Item->Kind) {
+            case tok_def:
+                DefineFunction(*Item->Fn, Item->Calls, Item->CacheKey);
+                break;
+            case tok_extern:
+                DeclareExtern(*Item->Proto);
+                break;
+            case 0:
+                EvaluateTopLevelExpr(*Item->Fn);
+                break;
+        }
+        EnforceMemoryBudget(&Item->Arena);
+        if (!Pipe.FreeItems.tryPush(Item))
+            delete Item;
+        if (ReportRequested)
+            ReportInstrumentation();
+    }
+    ParseThread.join();
+    LexThread.join();
 
-/// external ::= 'extern' prototype
-static std::unique_ptr<PrototypeAST> ParseExtern() 
-{
-    getNextToken;   // eat extern.
-    return ParsePrototype();
+    ParsedItem *Item;
+    while (Pipe.FreeItems.tryPop(Item))
+        delete Item;
 }
 
-/// toplevelexpr ::= expression
-static std::unique_ptr<FunctionAST> ParseTopLevelExpr()
-{
-    if (auto E = ParseExpression()) {
-        // Make an anonymous proto.
-        auto Proto = std::make_unique<PrototypeAST>("", std::vector<std::string>());
-        return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
-    }
-    return nullptr;
-}
 /*--------------------------------------------------------------------------------
- * Top-Level parsing
+ * Parallel parsing
  *------------------------------------------------------------------------------*/
-static void HandleDefinition()
+static cl::opt<unsigned> ParseThreads("parse-threads",
+        cl::desc("Cut each input file at the definitions and externs that start a "
+                 "line and parse the pieces on this many threads (default = 1)"),
+        cl::init(1));
+
+/// MinChunkSize - The smallest piece worth a parse task of its own.
+static const size_t MinChunkSize = 64 * 1024;
+
+/// ParsedChunk - One piece of an input and the top-level items parsed from it.
+/// All of their ASTs share one arena, and the errors reported while parsing are
+/// kept in Errors, each item recording where its own end.
+struct ParsedChunk
 {
-    if (ParseDefinition()) {
-        fprintf(stderr, "Parsed a function definition.\n");
-    } else {
-        // Skip token for error recovery.
-        getNextToken();
-    }
-}
+    struct Item
+    {
+        int Kind;               // tok_def, tok_extern, 0 for an expression, or
+                                // -1 for one that did not parse
+        FunctionAST *Fn;        // A definition or expression
+        PrototypeAST *Proto;    // An extern
+        size_t CallsEnd;        // Its calls end here in Calls, and its errors
+        size_t ErrorsEnd;       // here in Errors
+        std::string CacheKey;
+    };
+
+    llvm::StringRef Text;
+    std::vector<Item> Items;
+    std::vector<std::pair<SymbolID, unsigned>> Calls;
+    std::string Errors;
+    ASTArena Arena;
+};
 
-static void HandleExtern()
+/// FindItemStart - The offset of the first line at or after From that starts
+/// with a "def" or "extern" keyword, or Text.size() if there is none.  Text must
+/// be followed by a '\0', as a SourceBuffer is.  A comment never continues past
+/// the end of its line, so a keyword that starts one is never commented out.
+static size_t FindItemStart(llvm::StringRef Text, size_t From)
 {
-    if (ParseExtern()) {
-        fprintf(stderr, "Parsed an extern.\n");
-    } else {
-        // Skip for error recovery.
-        getNextToken();
+    const char *P = Text.begin() + From;
+    if (From != 0 && P[-1] != '\n' && P[-1] != '\r')
+        P = SkipToLineEnd(P);
+    while (P < Text.end()) {
+        if (*P == '\n' || *P == '\r' || *P == '\0')
+            ++P;
+        size_t Len = 0;
+        while (isalnum((unsigned char)P[Len]))
+            ++Len;
+        int Kind = Len && isalpha((unsigned char)*P)
+                   ? ClassifyIdentifier(llvm::StringRef(P, Len)) : tok_identifier;
+        if (Kind == tok_def || Kind == tok_extern)
+            return P - Text.begin();
+        P = SkipToLineEnd(P + Len);
     }
+    return Text.size();
 }
 
-static void HandleTopLevelExpression()
+/// SplitAtItems - Cut Text into at most NumPieces pieces of about the same size,
+/// each but the first starting with a definition or extern, so that each can
+/// be parsed on its own as though the others came before it.
+static std::vector<llvm::StringRef> SplitAtItems(llvm::StringRef Text, size_t NumPieces)
 {
-    // Evaluate a top-level expression into an anonymous function.
-    if (ParseTopLevelExpr()) {
-        fprintf(stderr, "Parsed a top-level expr\n");
-    } else {
-        // Skip for error recovery
-        getNextToken();
+    std::vector<llvm::StringRef> Pieces;
+    size_t Begin = 0;
+    for (size_t I = 1; I < NumPieces && Begin != Text.size(); ++I) {
+        size_t Cut = FindItemStart(Text, std::max(Begin + 1, Text.size() / NumPieces * I));
+        Pieces.push_back(Text.slice(Begin, Cut));
+        Begin = Cut;
     }
+    if (Begin != Text.size() || Pieces.empty())
+        Pieces.push_back(Text.substr(Begin));
+    return Pieces;
 }
-/// top ::= definition | external | expression | ';'
-static void MainLoop()
+
+/// ParseChunk - Parse every item of C, a piece of Whole, in place as MainLoop
+/// would, interning names through a cache into the driver's interner.
+static void ParseChunk(ParsedChunk &C, const SourceBuffer &Whole, std::mutex &SymbolsLock)
 {
-    while (true) {
-        fprintf(stderr, "ready> ");
-        switch (CurTok) {
-            case tok_eof:
-                return;
-            case ';':   // ignore top-level semicolons.
-                getNextToken();
-                break;
+    std::unique_ptr<SourceBuffer> SB = SourceBuffer::getView(Whole, C.Text);
+    SymbolCache Cache(Symbols, SymbolsLock);
+    Lexer Lex(Cache, *SB);
+    Parser P(Lex, C.Arena);
+    P.setHashConsing(HashCons);
+    P.setConstantFolding(FoldConstants);
+    DeferredErrors = &C.Errors;
+
+    // Prime the first token.
+    P.getNextToken();
+    while (P.getCurTok() != tok_eof) {
+        int Tok = P.getCurTok();
+        if (Tok == ';') {   // ignore top-level semicolons.
+            P.getNextToken();
+            continue;
+        }
+
+        ParsedChunk::Item Item = {Tok == tok_def || Tok == tok_extern ? Tok : 0, nullptr,
+                                  nullptr, 0, 0, ""};
+        switch (Item.Kind) {
             case tok_def:
-                HandleDefinition();
+                Item.Fn = ParseKeyedDefinition(P, Item.CacheKey);
                 break;
             case tok_extern:
-                HandleExtern();
+                Item.Proto = P.ParseExtern();
                 break;
             default:
-                HandleTopLevelExpression();
+                Item.Fn = P.ParseTopLevelExpr();
                 break;
-        }        
+        }
+        if (Item.Fn || Item.Proto) {
+            C.Calls.insert(C.Calls.end(), P.getCalls().begin(), P.getCalls().end());
+        } else {
+            // Skip token for error recovery.
+            Item.Kind = -1;
+            P.getNextToken();
+        }
+        Item.CallsEnd = C.Calls.size();
+        Item.ErrorsEnd = C.Errors.size();
+        C.Items.push_back(std::move(Item));
     }
+    DeferredErrors = nullptr;
 }
 
+/// RunChunked - Parse SB, which must be complete, in pieces on a pool of
+/// -parse-threads threads, while the main thread compiles and runs the items
+/// of each piece in order as soon as it has been parsed.  Each piece is freed
+/// once its items have been handled.
+static void RunChunked(SourceBuffer &SB)
+{
+    llvm::StringRef Text(SB.begin(), SB.end() - SB.begin());
+    size_t NumPieces = std::min<size_t>(4 * ParseThreads, Text.size() / MinChunkSize + 1);
+    std::vector<llvm::StringRef> Pieces = SplitAtItems(Text, NumPieces);
 
+    std::vector<std::unique_ptr<ParsedChunk>> Chunks;
+    std::vector<std::shared_future<void>> Parsed;
+    std::mutex SymbolsLock;
+    ThreadPool Pool(hardware_concurrency(ParseThreads));
+    for (llvm::StringRef Piece : Pieces) {
+        Chunks.push_back(std::make_unique<ParsedChunk>());
+        ParsedChunk *C = Chunks.back().get();
+        C->Text = Piece;
+        Parsed.push_back(
+                Pool.async([C, &SB, &SymbolsLock] { ParseChunk(*C, SB, SymbolsLock); }));
+    }
 
-int main() {
-    // Install standard binary operators.
-    // 1 is lowest precedence.
-    BinopPrecedence['<'] = 10;
-    BinopPrecedence['+'] = 20;
-    BinopPrecedence['-'] = 30;
-    BinopPrecedence['*'] = 40;	// highest.
-    // TODO: binary operators
-    return 0;
+    for (size_t I = 0; I != Chunks.size(); ++I) {
+        Parsed[I].wait();
+        ParsedChunk &C = *Chunks[I];
+        size_t CallsBegin = 0, ErrorsBegin = 0;
+        for (ParsedChunk::Item &Item : C.Items) {
+            fprintf(stderr, "ready> ");
+            fwrite(C.Errors.data() + ErrorsBegin, 1, Item.ErrorsEnd - ErrorsBegin, stderr);
+            auto Calls = makeArrayRef(C.Calls).slice(CallsBegin, Item.CallsEnd - CallsBegin);
+            switch (Item.Kind) {
+                case tok_def:
+                    DefineFunction(*Item.Fn, Calls, Item.CacheKey);
+                    break;
+                case tok_extern:
+                    DeclareExtern(*Item.Proto);
+                    break;
+                case 0:
+                    EvaluateTopLevelExpr(*Item.Fn);
+                    break;
+            }
+            CallsBegin = Item.CallsEnd;
+            ErrorsBegin = Item.ErrorsEnd;
+            if (ReportRequested)
+                ReportInstrumentation();
+            EnforceMemoryBudget(nullptr);
+        }
+        Chunks[I].reset();
+    }
+}
+
+static cl::list<std::string> InputFilenames(cl::Positional,
+        cl::desc("<input files>"), cl::ZeroOrMore);
+
+int main(int argc, char **argv) {
+    cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope JIT compiler\n");
+    if (OptLevel < '0' || OptLevel > '3') {
+        fprintf(stderr, "Error, invalid optimization level -O%c\n", (char)OptLevel);
+        return 1;
+    }
+    if (!OutputFilename.empty()) {
+        if (NumThreads > 1) {
+            fprintf(stderr, "Error, -o cannot be combined with -j\n");
+            return 1;
+        }
+        BatchMode = true;
+    }
+    if (Tiered && TierThreshold == 0) {
+        fprintf(stderr, "Error, -tier-threshold must be at least 1\n");
+        return 1;
+    }
+    if (Tiered)
+        UseInterpreter = true;
+    if (UseInterpreter && (BatchMode || NumThreads > 1 || !OutputFilename.empty() ||
+                           !CacheDir.empty() || BatchWrappers)) {
+        fprintf(stderr, "Error, -interp cannot be combined with -batch, -j, -o, "
+                        "-cache-dir or -batch-wrappers\n");
+        return 1;
+    }
+    if (LazyCompile && (UseInterpreter || NumThreads > 1 || !OutputFilename.empty() ||
+                        !CacheDir.empty() || BatchWrappers)) {
+        fprintf(stderr, "Error, -lazy cannot be combined with -interp, -tiered, -j, "
+                        "-o, -cache-dir or -batch-wrappers\n");
+        return 1;
+    }
+    if (Pipelined && (UseInterpreter || NumThreads > 1)) {
+        fprintf(stderr, "Error, -pipeline cannot be combined with -interp, -tiered or -j\n");
+        return 1;
+    }
+    if (ParseThreads > 1 && (Pipelined || UseInterpreter || NumThreads > 1)) {
+        fprintf(stderr, "Error, -parse-threads cannot be combined with -pipeline, -interp, "
+                        "-tiered or -j\n");
+        return 1;
+    }
+    if (NumThreads > 1)
+        BatchMode = true;
+
+    TimingPhases = TimePassesIsEnabled;
+    CountingStats = AreStatisticsEnabled();
+    if (TimingPhases || CountingStats)
+        signal(SIGUSR1, RequestReport);
+
+    // With no arguments, read the REPL from standard input; otherwise run each
+    // named file ("-" meaning standard input) in turn.
+    std::vector<std::string> Inputs(InputFilenames.begin(), InputFilenames.end());
+    if (Inputs.empty())
+        Inputs.push_back("-");
+
+    // The interpreter needs none of LLVM's code generation.
+    if (!UseInterpreter) {
+        InitializeJIT();
+
+        // Make the module, which holds all the code.
+        InitializeModule();
+    }
+
+    for (const std::string &Path : Inputs) {
+        std::unique_ptr<SourceBuffer> SB = Path == "-"
+                                           ? SourceBuffer::getStdin()
+                                           : SourceBuffer::getFile(Path.c_str());
+        if (!SB) {
+            fprintf(stderr, "Error, cannot read '%s': %s\n", Path.c_str(),
+                    strerror(errno));
+            return 1;
+        }
+        if (Pipelined) {
+            RunPipelined(*SB);
+        } else if (ParseThreads > 1 && SB->isComplete()) {
+            RunChunked(*SB);
+        } else {
+            Lexer Lex(Symbols, *SB);
+            Parser P(Lex, ItemArena);
+            P.setHashConsing(HashCons);
+            P.setConstantFolding(FoldConstants);
+
+            // Prime the first token.
+            fprintf(stderr, "ready> ");
+            P.getNextToken();
+
+            // Run the main "interpreter loop" now.
+            MainLoop(P);
+        }
+
+        if (NumThreads > 1)
+            RunParallelBatch();
+        else if (BatchMode && OutputFilename.empty())
+            RunBatch();
+    }
+
+    FinishTiering();
+    ReleaseDefinitions();
+    int Status = !OutputFilename.empty() && !EmitOutput() ? 1 : 0;
+    ReportInstrumentation();
+    return Status;
 }
+#endif // KALEIDOSCOPE_NO_MAIN
@@ -0,0 +1,58 @@
+#ifndef KALEIDOSCOPE_PRECEDENCE_H
+#define KALEIDOSCOPE_PRECEDENCE_H
+
+/*---------------------------------------------------------------------------------
+ * Binary operator precedence
+ *-------------------------------------------------------------------------------*/
+/// PrecedenceTable - The precedence of every binary operator, indexed directly by
+/// the operator's token.  Token values that are not binary operators (including
+/// the negative keyword tokens) read as -1, so a lookup is one bounds check and
+/// one load, and never allocates or inserts anything.
+class PrecedenceTable
+{
+    signed char Prec[256];
+
+public:
+    /// The range of precedences an operator may be given; 1 is lowest.
+    static constexpr int MinPrecedence = 1;
+    static constexpr int MaxPrecedence = 127;
+
+    constexpr PrecedenceTable() : Prec()
+    {
+        for (int I = 0; I != 256; ++I)
+            Prec[I] = -1;
+    }
+
+    /// standard - The table holding the built-in binary operators.
+    static constexpr PrecedenceTable standard()
+    {
+        PrecedenceTable T;
+        T.Prec['='] = 2;   // lowest: assignment.
+        T.Prec['<'] = 10;
+        T.Prec['+'] = 20;
+        T.Prec['-'] = 30;
+        T.Prec['*'] = 40;  // highest.
+        return T;
+    }
+
+    /// get - The precedence of Tok, or -1 if it is not a binary operator.
+    constexpr int get(int Tok) const
+    {
+        return (unsigned)Tok < 256 ? Prec[Tok] : -1;
+    }
+
+    /// set - Make Op a binary operator with the given precedence, e.g. for a
+    /// user-defined operator.  Returns false if Prec is out of range.
+    bool set(unsigned char Op, int P)
+    {
+        if (P < MinPrecedence || P > MaxPrecedence)
+            return false;
+        Prec[Op] = P;
+        return true;
+    }
+
+    /// remove - Stop treating Op as a binary operator.
+    void remove(unsigned char Op) { Prec[Op] = -1; }
+};
+
+#endif // KALEIDOSCOPE_PRECEDENCE_H
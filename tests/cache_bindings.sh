@@ -0,0 +1,29 @@
+#!/bin/sh
+# cache_bindings - A definition cached while the call in it named a libm extern,
+# and so compiled to an intrinsic, must not be served from -cache-dir once the
+# same call names a definition instead, nor the other way round.
+#
+# Usage: cache_bindings.sh <parser>
+Parser=${1:?usage: cache_bindings.sh <parser>}
+Dir=$(mktemp -d)
+trap 'rm -rf "$Dir"' EXIT
+
+echo 'extern sqrt(x); def f(x) sqrt(x); f(16);' > "$Dir/c1.k"
+echo 'def sqrt(x) x*2; def f(x) sqrt(x); f(16);' > "$Dir/c2.k"
+
+# expect - Run the parser on input $1 against the shared cache, and fail unless
+# it evaluates to $2.
+expect()
+{
+    Output=$("$Parser" -O0 -cache-dir="$Dir/kcache" "$Dir/$1" 2>&1)
+    if ! echo "$Output" | grep -q "Evaluated to $2"; then
+        echo "$1: expected $2, got:"
+        echo "$Output"
+        exit 1
+    fi
+}
+
+expect c1.k 4.000000
+expect c2.k 32.000000
+expect c1.k 4.000000
+expect c2.k 32.000000